@@ -0,0 +1,470 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "benchmark.h"
+#include "executor.h"
+#include "scheduler.h"
+#include "task.h"
+#include "lazy_task.h"
+#include "channel.h"
+#include "spsc_channel.h"
+
+// 统计整个进程的堆分配次数, 用于计算每次 execute 的分配次数。
+// 替换全局的 operator new 会影响所有的示例, 所以只在定义了 COUNT_HEAP_ALLOCATIONS 时替换
+// (cmake -DCOUNT_HEAP_ALLOCATIONS=ON); 协程恢复路径上的分配由 unique_function_heap_allocations() 单独统计。
+static std::atomic<std::size_t> g_heap_allocation_count{0};
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+static constexpr bool kCountsHeapAllocations = true;
+
+// 不内联, 否则 GCC 看到 free 的是 operator new 返回的指针会警告 (-Wmismatched-new-delete)。
+[[gnu::noinline]] void* operator new(std::size_t size) {
+  g_heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (auto ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+[[gnu::noinline]] void operator delete(void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+#else
+static constexpr bool kCountsHeapAllocations = false;
+#endif
+
+namespace {
+
+struct LooperResult {
+  double ms;
+  double allocations_per_execute;   // 包括生产者线程的创建; 没有定义 COUNT_HEAP_ALLOCATIONS 时为 0
+};
+
+void print_allocations(double allocations_per_execute, int width) {
+  if (kCountsHeapAllocations) {
+    std::cout << std::setw(width) << std::setprecision(4) << allocations_per_execute;
+  } else {
+    std::cout << std::setw(width) << "-";
+  }
+}
+
+// max_backlog 不为 0 时, 已经提交但还没有执行的任务超过 max_backlog 个时生产者等待。
+LooperResult measure_looper(LooperExecutor::QueueMode mode, int producer_count, int total_count, int max_backlog = 0) {
+  using namespace std::chrono;
+
+  std::atomic<int> executed_count{0};
+  std::atomic<int> submitted_count{0};
+  std::size_t allocation_count;
+  auto start = steady_clock::now();
+  {
+    LooperExecutor executor(mode);
+    auto allocation_start = g_heap_allocation_count.load(std::memory_order_relaxed);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producer_count; p++) {
+      producers.emplace_back([&, p]() {
+          for (int i = p; i < total_count; i += producer_count) {
+            if (max_backlog > 0) {
+              while (submitted_count.fetch_add(1, std::memory_order_relaxed) - executed_count.load(std::memory_order_relaxed) >= max_backlog) {
+                submitted_count.fetch_sub(1, std::memory_order_relaxed);
+                std::this_thread::yield();
+              }
+            }
+            executor.execute([&executed_count]() {
+                executed_count.fetch_add(1, std::memory_order_relaxed);
+              });
+          }
+        });
+    }
+    for (auto& producer : producers) {
+      producer.join();
+    }
+    while (executed_count.load(std::memory_order_relaxed) < total_count) {
+      std::this_thread::yield();
+    }
+    allocation_count = g_heap_allocation_count.load(std::memory_order_relaxed) - allocation_start;
+  }
+  return {duration<double, std::milli>(steady_clock::now() - start).count(), double(allocation_count) / total_count};
+}
+
+// 一直不会触发的超时: 每次 arm 之后立即 cancel, 或者先全部 arm 再全部 cancel.
+double measure_timer_cancel(TimerBackend backend, int cycle_count, bool does_batch) {
+  using namespace std::chrono;
+
+  Scheduler scheduler(backend);
+  auto start = steady_clock::now();
+  if (does_batch) {
+    std::vector<TimerHandle> handles;
+    handles.reserve(cycle_count);
+    for (int i = 0; i < cycle_count; i++) {
+      handles.push_back(scheduler.execute([]() {}, 60000 + i % 1000));
+    }
+    for (auto& handle : handles) {
+      handle.cancel();
+    }
+  } else {
+    for (int i = 0; i < cycle_count; i++) {
+      auto handle = scheduler.execute([]() {}, 60000 + i % 1000);
+      handle.cancel();
+    }
+  }
+  return duration<double, std::milli>(steady_clock::now() - start).count();
+}
+
+// 依次设置 sample_count 个定时器, 每个在前一个触发后设置, 记录实际触发时间比 deadline 晚了多少。
+std::vector<long long> measure_timer_jitter(TimerBackend backend, WaitMode wait_mode, std::chrono::nanoseconds delay, int sample_count) {
+  std::vector<long long> lateness;
+  lateness.reserve(sample_count);
+  std::atomic<bool> is_done{false};
+
+  Scheduler scheduler(backend, wait_mode);
+  UniqueFunction<void()> arm;
+  long long deadline = 0;
+  arm = [&]() {
+      deadline = current_time() + delay.count();
+      scheduler.execute([&]() {
+          lateness.push_back(current_time() - deadline);
+          if (static_cast<int>(lateness.size()) < sample_count) {
+            arm();
+          } else {
+            is_done.store(true, std::memory_order_release);
+            is_done.notify_one();
+          }
+        }, delay);
+    };
+  arm();
+  is_done.wait(false, std::memory_order_acquire);
+
+  std::sort(lateness.begin(), lateness.end());
+  return lateness;
+}
+
+// timer_count 个定时器在同一时刻到期, 返回从 deadline 到全部执行完的时间。
+double measure_timer_burst(TimerBackend backend, int timer_count, TimerLag& lag) {
+  using namespace std::chrono;
+
+  Scheduler scheduler(backend);
+  std::atomic<int> fired_count{0};
+  auto delay = 20ms;
+  auto deadline = current_time() + duration_cast<nanoseconds>(delay).count();
+  for (int i = 0; i < timer_count; i++) {
+    scheduler.execute([&fired_count]() {
+        fired_count.fetch_add(1, std::memory_order_relaxed);
+      }, nanoseconds(deadline - current_time()));
+  }
+  while (fired_count.load(std::memory_order_relaxed) < timer_count) {
+    std::this_thread::yield();
+  }
+  auto elapsed = current_time() - deadline;
+  lag = scheduler.timer_lag();
+  return elapsed / 1e6;
+}
+
+
+Task<int, LooperExecutor> eager_child(LooperExecutor&, int i) {
+  co_return i;
+}
+
+LazyTask<int> lazy_child(int i) {
+  co_return i;
+}
+
+// 父协程依次 co_await child_count 个子协程
+Task<long long, LooperExecutor> await_children(LooperExecutor& executor, int child_count, bool is_lazy) {
+  long long sum = 0;
+  for (int i = 0; i < child_count; i++) {
+    if (is_lazy) {
+      sum += co_await lazy_child(i);
+    } else {
+      sum += co_await eager_child(executor, i);
+    }
+  }
+  co_return sum;
+}
+
+double measure_child_await(int child_count, bool is_lazy) {
+  using namespace std::chrono;
+
+  LooperExecutor executor;
+  auto start = steady_clock::now();
+  await_children(executor, child_count, is_lazy).get_result();
+  return duration<double, std::milli>(steady_clock::now() - start).count();
+}
+
+
+Task<void, LooperExecutor> channel_producer(LooperExecutor&, Channel<int>& channel, int count) {
+  for (int i = 0; i < count; i++) {
+    co_await (channel << i);
+  }
+}
+
+Task<void, LooperExecutor> channel_consumer(LooperExecutor&, Channel<int>& channel, int count) {
+  int value;
+  for (int i = 0; i < count; i++) {
+    co_await (channel >> value);
+  }
+}
+
+// pair_count 对生产者和消费者, 每个协程在自己的 LooperExecutor 线程上
+double measure_channel(Channel<int>::BufferMode mode, int pair_count, int total_count) {
+  using namespace std::chrono;
+
+  Channel<int> channel(1024, mode);
+  std::vector<std::unique_ptr<LooperExecutor>> executors;
+  for (int i = 0; i < pair_count * 2; i++) {
+    executors.push_back(std::make_unique<LooperExecutor>());
+  }
+  auto count = total_count / pair_count;
+  auto start = steady_clock::now();
+  std::vector<Task<void, LooperExecutor>> tasks;
+  for (int i = 0; i < pair_count; i++) {
+    tasks.push_back(channel_consumer(*executors[i * 2], channel, count));
+    tasks.push_back(channel_producer(*executors[i * 2 + 1], channel, count));
+  }
+  for (auto& task : tasks) {
+    task.get_result();
+  }
+  return duration<double, std::milli>(steady_clock::now() - start).count();
+}
+
+
+// 每次批量读写 batch_size 个值
+Task<void, LooperExecutor> batch_producer(LooperExecutor&, Channel<int>& channel, int count, int batch_size) {
+  std::vector<int> values(batch_size);
+  for (int i = 0; i < count; i += batch_size) {
+    for (int j = 0; j < batch_size; j++) {
+      values[j] = i + j;
+    }
+    co_await channel.write_many(values);
+  }
+}
+
+Task<void, LooperExecutor> batch_consumer(LooperExecutor&, Channel<int>& channel, int count, int batch_size) {
+  std::vector<int> values(batch_size);
+  for (int i = 0; i < count;) {
+    i += co_await channel.read_many(values);
+  }
+}
+
+double measure_channel_batch(Channel<int>::BufferMode mode, int batch_size, int total_count) {
+  using namespace std::chrono;
+
+  Channel<int> channel(1024, mode);
+  LooperExecutor consumer_executor;
+  LooperExecutor producer_executor;
+  auto start = steady_clock::now();
+  auto consumer = batch_consumer(consumer_executor, channel, total_count, batch_size);
+  auto producer = batch_producer(producer_executor, channel, total_count, batch_size);
+  consumer.get_result();
+  producer.get_result();
+  return duration<double, std::milli>(steady_clock::now() - start).count();
+}
+
+Task<void, LooperExecutor> spsc_producer(LooperExecutor&, SpscChannel<int>& channel, int count) {
+  for (int i = 0; i < count; i++) {
+    co_await (channel << i);
+  }
+}
+
+Task<void, LooperExecutor> spsc_consumer(LooperExecutor&, SpscChannel<int>& channel, int count) {
+  int value;
+  for (int i = 0; i < count; i++) {
+    co_await (channel >> value);
+  }
+}
+
+double measure_spsc_channel(int total_count) {
+  using namespace std::chrono;
+
+  SpscChannel<int> channel(1024);
+  LooperExecutor consumer_executor;
+  LooperExecutor producer_executor;
+  auto start = steady_clock::now();
+  auto consumer = spsc_consumer(consumer_executor, channel, total_count);
+  auto producer = spsc_producer(producer_executor, channel, total_count);
+  consumer.get_result();
+  producer.get_result();
+  return duration<double, std::milli>(steady_clock::now() - start).count();
+}
+
+}
+
+void bench_looper_executor() {
+  const int total_count = 1000000;
+
+  std::cout << "LooperExecutor: " << total_count << " executes, heap allocations per execute" << std::endl;
+  if (!kCountsHeapAllocations) {
+    std::cout << "(build with -DCOUNT_HEAP_ALLOCATIONS=ON to count heap allocations)" << std::endl;
+  }
+  std::cout << std::setw(10) << "producers"
+            << std::setw(14) << "mutex(ms)"
+            << std::setw(14) << "lock-free(ms)"
+            << std::setw(16) << "mutex allocs"
+            << std::setw(18) << "lock-free allocs" << std::endl;
+  for (int producer_count = 1; producer_count <= 64; producer_count *= 2) {
+    auto mutex = measure_looper(LooperExecutor::QueueMode::Mutex, producer_count, total_count);
+    auto lock_free = measure_looper(LooperExecutor::QueueMode::LockFree, producer_count, total_count);
+    std::cout << std::setw(10) << producer_count
+              << std::setw(14) << std::fixed << std::setprecision(1) << mutex.ms
+              << std::setw(14) << lock_free.ms;
+    print_allocations(mutex.allocations_per_execute, 16);
+    print_allocations(lock_free.allocations_per_execute, 18);
+    std::cout << std::endl;
+  }
+
+  // 生产者不会远远超过消费者时, 队列的块可以循环使用
+  const int max_backlog = 256;
+  std::cout << "LooperExecutor: " << total_count << " executes, at most " << max_backlog << " pending" << std::endl;
+  std::cout << std::setw(10) << "producers"
+            << std::setw(14) << "mutex(ms)"
+            << std::setw(14) << "lock-free(ms)"
+            << std::setw(16) << "mutex allocs"
+            << std::setw(18) << "lock-free allocs" << std::endl;
+  for (int producer_count = 1; producer_count <= 16; producer_count *= 4) {
+    auto mutex = measure_looper(LooperExecutor::QueueMode::Mutex, producer_count, total_count, max_backlog);
+    auto lock_free = measure_looper(LooperExecutor::QueueMode::LockFree, producer_count, total_count, max_backlog);
+    std::cout << std::setw(10) << producer_count
+              << std::setw(14) << std::fixed << std::setprecision(1) << mutex.ms
+              << std::setw(14) << lock_free.ms;
+    print_allocations(mutex.allocations_per_execute, 16);
+    print_allocations(lock_free.allocations_per_execute, 18);
+    std::cout << std::endl;
+  }
+}
+
+void bench_timer_cancel() {
+  const int cycle_count = 1000000;
+
+  std::cout << "Scheduler: " << cycle_count << " arm/cancel cycles" << std::endl;
+  std::cout << std::setw(10) << "backend"
+            << std::setw(16) << "one-by-one(ms)"
+            << std::setw(14) << "batched(ms)" << std::endl;
+  for (auto backend : {TimerBackend::Heap, TimerBackend::Wheel}) {
+    auto one_by_one_ms = measure_timer_cancel(backend, cycle_count, false);
+    auto batched_ms = measure_timer_cancel(backend, cycle_count, true);
+    std::cout << std::setw(10) << (backend == TimerBackend::Heap ? "heap" : "wheel")
+              << std::setw(16) << std::fixed << std::setprecision(1) << one_by_one_ms
+              << std::setw(14) << batched_ms << std::endl;
+  }
+}
+
+void bench_timer_jitter() {
+  using namespace std::chrono_literals;
+  const int sample_count = 2000;
+  const auto delay = 200us;
+
+  std::cout << "Scheduler: wake-up lateness of " << sample_count << " 200us timers" << std::endl;
+  std::cout << std::setw(10) << "backend"
+            << std::setw(10) << "wait"
+            << std::setw(12) << "p50(us)"
+            << std::setw(12) << "p99(us)" << std::endl;
+  for (auto backend : {TimerBackend::Heap, TimerBackend::Wheel}) {
+    for (auto wait_mode : {WaitMode::Block, WaitMode::Hybrid}) {
+      auto lateness = measure_timer_jitter(backend, wait_mode, delay, sample_count);
+      std::cout << std::setw(10) << (backend == TimerBackend::Heap ? "heap" : "wheel")
+                << std::setw(10) << (wait_mode == WaitMode::Block ? "block" : "hybrid")
+                << std::setw(12) << std::fixed << std::setprecision(1) << lateness[sample_count / 2] / 1000.0
+                << std::setw(12) << lateness[sample_count * 99 / 100] / 1000.0 << std::endl;
+    }
+  }
+}
+
+void bench_timer_burst() {
+  const int timer_count = 10000;
+
+  std::cout << "Scheduler: " << timer_count << " timers expiring together" << std::endl;
+  std::cout << std::setw(10) << "backend"
+            << std::setw(12) << "drain(ms)"
+            << std::setw(16) << "mean lag(us)"
+            << std::setw(14) << "max lag(us)" << std::endl;
+  for (auto backend : {TimerBackend::Heap, TimerBackend::Wheel}) {
+    TimerLag lag;
+    auto drain_ms = measure_timer_burst(backend, timer_count, lag);
+    std::cout << std::setw(10) << (backend == TimerBackend::Heap ? "heap" : "wheel")
+              << std::setw(12) << std::fixed << std::setprecision(2) << drain_ms
+              << std::setw(16) << std::setprecision(1) << lag.mean() / 1000.0
+              << std::setw(14) << lag.m_max / 1000.0 << std::endl;
+  }
+}
+
+void bench_lazy_task() {
+  const int child_count = 1000000;
+
+  std::cout << "Task: " << child_count << " awaited children on one LooperExecutor" << std::endl;
+  std::cout << std::setw(10) << "mode"
+            << std::setw(12) << "total(ms)"
+            << std::setw(14) << "per child(ns)" << std::endl;
+  for (auto is_lazy : {false, true}) {
+    auto total_ms = measure_child_await(child_count, is_lazy);
+    std::cout << std::setw(10) << (is_lazy ? "lazy" : "eager")
+              << std::setw(12) << std::fixed << std::setprecision(1) << total_ms
+              << std::setw(14) << total_ms * 1e6 / child_count << std::endl;
+  }
+}
+
+void bench_channel() {
+  const int total_count = 1000000;
+
+  std::cout << "Channel(1024): " << total_count << " values" << std::endl;
+  std::cout << std::setw(10) << "pairs"
+            << std::setw(14) << "queue(ms)"
+            << std::setw(14) << "ring(ms)" << std::endl;
+  for (int pair_count = 1; pair_count <= 8; pair_count *= 2) {
+    auto queue_ms = measure_channel(Channel<int>::BufferMode::Queue, pair_count, total_count);
+    auto ring_ms = measure_channel(Channel<int>::BufferMode::Ring, pair_count, total_count);
+    std::cout << std::setw(10) << pair_count
+              << std::setw(14) << std::fixed << std::setprecision(1) << queue_ms
+              << std::setw(14) << ring_ms << std::endl;
+  }
+}
+
+void bench_channel_batch() {
+  const int total_count = 1 << 20;
+
+  std::cout << "Channel(1024) write_many/read_many, 1 producer, 1 consumer: " << total_count << " values" << std::endl;
+  std::cout << std::setw(10) << "batch"
+            << std::setw(14) << "queue(ms)"
+            << std::setw(14) << "ring(ms)" << std::endl;
+  for (int batch_size = 1; batch_size <= 256; batch_size *= 4) {
+    auto queue_ms = measure_channel_batch(Channel<int>::BufferMode::Queue, batch_size, total_count);
+    auto ring_ms = measure_channel_batch(Channel<int>::BufferMode::Ring, batch_size, total_count);
+    std::cout << std::setw(10) << batch_size
+              << std::setw(14) << std::fixed << std::setprecision(1) << queue_ms
+              << std::setw(14) << ring_ms << std::endl;
+  }
+}
+
+void bench_spsc_channel() {
+  const int total_count = 1000000;
+
+  std::cout << "1 producer, 1 consumer, capacity 1024: " << total_count << " values" << std::endl;
+  std::cout << std::setw(14) << "queue(ms)"
+            << std::setw(14) << "ring(ms)"
+            << std::setw(14) << "spsc(ms)" << std::endl;
+  auto queue_ms = measure_channel(Channel<int>::BufferMode::Queue, 1, total_count);
+  auto ring_ms = measure_channel(Channel<int>::BufferMode::Ring, 1, total_count);
+  auto spsc_ms = measure_spsc_channel(total_count);
+  std::cout << std::setw(14) << std::fixed << std::setprecision(1) << queue_ms
+            << std::setw(14) << ring_ms
+            << std::setw(14) << spsc_ms << std::endl;
+}
+
+void run_benchmarks() {
+  bench_looper_executor();
+  bench_timer_cancel();
+  bench_timer_jitter();
+  bench_timer_burst();
+  bench_lazy_task();
+  bench_channel();
+  bench_channel_batch();
+  bench_spsc_channel();
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// 运行 `app bench` 时执行, 不包含在默认的示例中。
+void bench_looper_executor();
+void bench_timer_cancel();
+void bench_timer_jitter();
+void bench_timer_burst();
+void bench_lazy_task();
+void bench_channel();
+void bench_channel_batch();
+void bench_spsc_channel();
+
+void run_benchmarks();
@@ -1,12 +1,20 @@
 #pragma once
 
-#include <list>
-#include <queue>
+#include <algorithm>
+#include <cstddef>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <stdexcept>
+#include <span>
+#include <type_traits>
+#include <utility>
 
 #include "channel_awaiter.h"
+#include "intrusive_list.h"
+#include "mpmc_ring.h"
+#include "ring_buffer.h"
 
 template<typename T>
 class WriterAwaiter;
@@ -14,6 +22,66 @@ class WriterAwaiter;
 template<typename T>
 class ReaderAwaiter;
 
+template<typename T>
+struct ChannelReadWaiter;
+
+template<typename T>
+struct ChannelWriteWaiter;
+
+template<typename T>
+class WriteManyAwaiter;
+
+template<typename T>
+class ReadManyAwaiter;
+
+// 在锁内收集完成的读写操作 (通过 m_next_completed 串起来, 不分配内存), 在锁外面按完成的顺序唤醒。
+template<typename T>
+struct CompletedWaiters {
+  void add(ChannelReadWaiter<T>* reader) {
+    reader->m_next_completed = nullptr;
+    *m_reader_tail = reader;
+    m_reader_tail = &reader->m_next_completed;
+  }
+  void add(ChannelWriteWaiter<T>* writer) {
+    writer->m_next_completed = nullptr;
+    *m_writer_tail = writer;
+    m_writer_tail = &writer->m_next_completed;
+  }
+
+  // 不唤醒调用者自己 (self_reader/self_writer), 返回它是否完成了。
+  // 被唤醒的 awaiter 可能马上被销毁, 先取出 m_next_completed.
+  bool wake(ChannelReadWaiter<T>* self_reader, ChannelWriteWaiter<T>* self_writer) {
+    bool is_self_completed = false;
+    for (auto reader = m_readers; reader;) {
+      auto next = reader->m_next_completed;
+      if (reader == self_reader) {
+        is_self_completed = true;
+      } else {
+        reader->wake();
+      }
+      reader = next;
+    }
+    for (auto writer = m_writers; writer;) {
+      auto next = writer->m_next_completed;
+      if (writer == self_writer) {
+        is_self_completed = true;
+      } else {
+        writer->wake();
+      }
+      writer = next;
+    }
+    return is_self_completed;
+  }
+
+  ChannelReadWaiter<T>* m_readers = nullptr;
+  ChannelReadWaiter<T>** m_reader_tail = &m_readers;
+  ChannelWriteWaiter<T>* m_writers = nullptr;
+  ChannelWriteWaiter<T>** m_writer_tail = &m_writers;
+};
+
+template<typename... Ops>
+class SelectAwaiter;
+
 template<typename T>
 class Channel {
 public:
@@ -23,7 +91,22 @@ public:
     }
   };
 
-  Channel(unsigned long capacity = 0) : m_buffer_capacity(capacity) {
+  // Queue: 缓冲区是预先分配的环形缓冲区 (RingBuffer), 每次读写都加锁。批量读写时可以平凡复制的 T 整段 memcpy.
+  // Ring: 缓冲区是预先分配的无锁环形队列 (MpmcRing, 容量向上取整到 2 的幂, 至少为 2)。缓冲区不空 (读) 或者不满 (写) 时
+  //       在 await_ready 中直接完成, 不加锁也不挂起; 只有需要等待时才加锁访问等待列表。
+  enum class BufferMode {
+    Queue,
+    Ring,
+  };
+
+  Channel(unsigned long capacity = 0, BufferMode mode = BufferMode::Queue)
+    : m_buffer(mode == BufferMode::Queue ? capacity : 0) {
+    if (mode == BufferMode::Ring) {
+      if (capacity == 0) {
+        throw std::invalid_argument("Ring channel needs a capacity greater than 0");
+      }
+      m_ring = std::make_unique<MpmcRing<T>>(capacity);
+    }
     m_is_active.store(true, std::memory_order_relaxed);
   }
   Channel(const Channel&) = delete;
@@ -41,84 +124,131 @@ public:
 
   ReaderAwaiter<T> read() {
     check_closed();
-    std::lock_guard lg(m_mtx);
     return {this};
   }
-  WriterAwaiter<T> write(T& value) {
+  // 左值复制一次进 WriterAwaiter, 右值移动进去; 之后到 reader 的每一步都只移动一次, T 可以是只能移动的类型。
+  WriterAwaiter<T> write(const T& value) {
     check_closed();
-    std::lock_guard lg(m_mtx);
     return {this, value};
   }
+  WriterAwaiter<T> write(T&& value) {
+    check_closed();
+    return {this, std::move(value)};
+  }
+  // 在 WriterAwaiter 中直接用 args 构造要写入的值
+  template<typename... Args>
+  WriterAwaiter<T> emplace(Args&&... args) {
+    check_closed();
+    return {this, std::in_place, std::forward<Args>(args)...};
+  }
   ReaderAwaiter<T> operator>>(T& value) {
     auto ra = read();
     ra.m_value_ptr = &value;
     return ra;
   }
-  WriterAwaiter<T> operator<<(T& value) {
+  WriterAwaiter<T> operator<<(const T& value) {
     return write(value);
   }
+  WriterAwaiter<T> operator<<(T&& value) {
+    return write(std::move(value));
+  }
 
-  void try_push_reader(ReaderAwaiter<T>* reader) {
+  // values 只能复制, 不能移动; 只能移动的 T 请逐个 write(std::move(value))
+  WriteManyAwaiter<T> write_many(std::span<const T> values) {
+    static_assert(std::is_copy_constructible_v<T>, "write_many copies the values, T must be copy constructible");
     check_closed();
-    std::unique_lock lock(m_mtx);
-
-    if (!m_buffer.empty()) {
-      auto v = m_buffer.front();
-      m_buffer.pop();
-      lock.unlock();
-
-      reader->resume(v);
-      return;
+    return {this, values};
+  }
+  // min_count 不能超过 values.size()
+  ReadManyAwaiter<T> read_many(std::span<T> values, std::size_t min_count = 1) {
+    if (min_count > values.size()) {
+      throw std::invalid_argument("min_count is greater than the size of values");
     }
+    check_closed();
+    return {this, values, min_count};
+  }
 
-    if (m_writer_list.size()) {
-      auto writer = m_writer_list.front();
-      m_writer_list.pop_front();
-      lock.unlock();
-
-      reader->resume(writer->m_value);
-      writer->resume();
-
-      return;
+  // Ring 模式下不挂起的读写, 尽量多地从缓冲区取出 (或放进缓冲区)。之后如果有对方在等待, 再加锁交接。
+  // 与 try_push_reader/try_push_writer 中的顺序相反 (先修改缓冲区再读等待的数量), 两边都有 fence, 不会丢失唤醒。
+  // 返回是否已经完成 (读够 m_min_count 个, 或者全部写完)。
+  bool try_read_buffered(ChannelReadWaiter<T>* reader) {
+    if (!m_ring) {
+      return false;
     }
-
-    m_reader_list.push_back(reader);
-    lock.unlock();
+    auto count = reader->m_count;
+    while (reader->remaining() > 0 && m_ring->try_pop(reader->m_values[reader->m_count])) {
+      reader->m_count++;
+    }
+    if (reader->m_count == count) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_waiting_writer_count.load(std::memory_order_relaxed) > 0) {
+      transfer_waiters();
+    }
+    return reader->is_satisfied();
+  }
+  bool try_write_buffered(ChannelWriteWaiter<T>* writer) {
+    if (!m_ring) {
+      return false;
+    }
+    auto written = writer->m_written;
+    while (writer->remaining() > 0 && push_to_ring(writer)) {}
+    if (writer->m_written == written) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_waiting_reader_count.load(std::memory_order_relaxed) > 0) {
+      transfer_waiters();
+    }
+    return writer->remaining() == 0;
   }
 
-  void try_push_writer(WriterAwaiter<T>* writer) {
-    check_closed();
+  // 在一次加锁中尽量多地读取, 不够时加入等待列表。返回是否已经读够, 这时由调用者自己恢复。
+  bool try_push_reader(ChannelReadWaiter<T>* reader) {
     std::unique_lock lock(m_mtx);
+    check_closed();
 
-    if (m_reader_list.size()) {
-      auto reader = m_reader_list.front();
-      m_reader_list.pop_front();
-      lock.unlock();
-
-      reader->resume(writer->m_value);
-      writer->resume();
-
-      return;
-    }
-
-    if (m_buffer.size() < m_buffer_capacity) {
-      m_buffer.push(writer->m_value);
-      lock.unlock();
+    CompletedWaiters<T> completed;
+    push_reader_locked(reader, completed);
+    lock.unlock();
 
-      writer->resume();
+    return completed.wake(reader, nullptr);
+  }
 
-      return;
-    }
+  // 在一次加锁中尽量多地写入, 写不完时加入等待列表。返回是否已经全部写完, 这时由调用者自己恢复。
+  bool try_push_writer(ChannelWriteWaiter<T>* writer) {
+    std::unique_lock lock(m_mtx);
+    check_closed();
 
-    m_writer_list.push_back(writer);
+    CompletedWaiters<T> completed;
+    push_writer_locked(writer, completed);
     lock.unlock();
+
+    return completed.wake(nullptr, writer);
   }
 
-  void remove_writer(WriterAwaiter<T>* wa) {
-    m_writer_list.remove(wa);
+  // 返回是否还在等待列表中。节点在 awaiter 自身中, 直接摘下, 不需要查找
+  // 等待列表的长度只在 Ring 模式下记录 (见 push_writer_locked), Queue 模式下不需要更新。
+  bool remove_writer(ChannelWriteWaiter<T>* wa) {
+    std::lock_guard lg(m_mtx);
+    if (!m_writer_list.erase(wa)) {
+      return false;
+    }
+    if (m_ring) {
+      m_waiting_writer_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return true;
   }
-  void remove_reader(ReaderAwaiter<T>* ra) {
-    m_reader_list.remove(ra);
+  bool remove_reader(ChannelReadWaiter<T>* ra) {
+    std::lock_guard lg(m_mtx);
+    if (!m_reader_list.erase(ra)) {
+      return false;
+    }
+    if (m_ring) {
+      m_waiting_reader_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return true;
   }
 
   void close() {
@@ -128,19 +258,31 @@ public:
     }
   }
   void clean_up() {
-    std::lock_guard lg(m_mtx);
-    for (auto& w : m_writer_list) {
-      w->resume();
+    std::unique_lock lock(m_mtx);
+    m_waiting_writer_count.store(0, std::memory_order_relaxed);
+    m_waiting_reader_count.store(0, std::memory_order_relaxed);
+    m_buffer.clear();
+    if (m_ring) {
+      m_ring->clear();
     }
-    m_writer_list.clear();
-
-    for (auto& r : m_reader_list) {
-      r->resume_unsafe();
+    // 在锁内摘下所有等待的操作。select 中的操作只有抢占成功时才唤醒, 其余的由 select 自己撤销
+    CompletedWaiters<T> completed;
+    while (!m_writer_list.empty()) {
+      auto writer = m_writer_list.pop_front();
+      if (claim_waiter(writer)) {
+        completed.add(writer);
+      }
+    }
+    while (!m_reader_list.empty()) {
+      auto reader = m_reader_list.pop_front();
+      if (claim_waiter(reader)) {
+        completed.add(reader);
+      }
     }
-    m_reader_list.clear();
-    
-    decltype(m_buffer) empty_buffer;
-    std::exchange(m_buffer, empty_buffer);
+    lock.unlock();
+
+    // 在锁外面恢复, 被恢复的协程可能会再访问这个 Channel
+    completed.wake(nullptr, nullptr);
   }
 
   bool is_active() {
@@ -148,13 +290,182 @@ public:
   }
 
 private:
+  template<typename... Ops>
+  friend class SelectAwaiter;
+
+  // 在锁内调用。Ring 模式下先加入等待列表再交接, 与不加锁的读写之间不会丢失唤醒。
+  void push_reader_locked(ChannelReadWaiter<T>* reader, CompletedWaiters<T>& completed) {
+    if (m_ring) {
+      m_reader_list.push_back(reader);
+      m_waiting_reader_count.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      transfer_waiters(completed);
+      return;
+    }
+    fill_reader(reader, completed);
+    if (reader->is_satisfied() && claim_waiter(reader)) {
+      completed.add(reader);
+    } else {
+      m_reader_list.push_back(reader);
+    }
+  }
+  void push_writer_locked(ChannelWriteWaiter<T>* writer, CompletedWaiters<T>& completed) {
+    if (m_ring) {
+      m_writer_list.push_back(writer);
+      m_waiting_writer_count.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      transfer_waiters(completed);
+      return;
+    }
+    drain_writer(writer, completed);
+    if (writer->remaining() == 0 && claim_waiter(writer)) {
+      completed.add(writer);
+    } else {
+      m_writer_list.push_back(writer);
+    }
+  }
+
+  // Queue 模式, 在锁内调用: 先从缓冲区读, 再直接从等待的 writer 读; 之后缓冲区空出的位置用等待的 writer 的数据补上。
+  // 等待列表中属于 select 的操作在交接之前抢占, 失败时丢弃。
+  void fill_reader(ChannelReadWaiter<T>* reader, CompletedWaiters<T>& completed) {
+    reader->m_count += m_buffer.pop_many(reader->m_values + reader->m_count, reader->remaining());
+    while (reader->remaining() > 0 && !m_writer_list.empty()) {
+      auto writer = m_writer_list.front();
+      if (writer->m_written == 0 && !claim_waiter(writer)) {
+        m_writer_list.pop_front();
+        continue;
+      }
+      auto count = std::min(reader->remaining(), writer->remaining());
+      writer->take(count, reader->m_values + reader->m_count);
+      reader->m_count += count;
+      if (writer->remaining() == 0) {
+        m_writer_list.pop_front();
+        completed.add(writer);
+      }
+    }
+    while (!m_buffer.full() && !m_writer_list.empty()) {
+      auto writer = m_writer_list.front();
+      if (writer->m_written == 0 && !claim_waiter(writer)) {
+        m_writer_list.pop_front();
+        continue;
+      }
+      push_to_buffer(writer);
+      if (writer->remaining() == 0) {
+        m_writer_list.pop_front();
+        completed.add(writer);
+      }
+    }
+  }
+
+  // Queue 模式, 在锁内调用: 先直接交给等待的 reader, 再放进缓冲区。
+  void drain_writer(ChannelWriteWaiter<T>* writer, CompletedWaiters<T>& completed) {
+    while (writer->remaining() > 0 && !m_reader_list.empty()) {
+      auto reader = m_reader_list.front();
+      if (reader->m_count == 0 && !claim_waiter(reader)) {
+        m_reader_list.pop_front();
+        continue;
+      }
+      auto count = std::min(reader->remaining(), writer->remaining());
+      writer->take(count, reader->m_values + reader->m_count);
+      reader->m_count += count;
+      if (reader->is_satisfied()) {
+        m_reader_list.pop_front();
+        completed.add(reader);
+      }
+    }
+    push_to_buffer(writer);
+  }
+
+  void push_to_buffer(ChannelWriteWaiter<T>* writer) {
+    m_buffer.push_with(writer->remaining(), [writer](T* dst, std::size_t count) {
+        writer->take(count, dst);
+      });
+  }
+  bool push_to_ring(ChannelWriteWaiter<T>* writer) {
+    return writer->take_one([this](T&& value) {
+        return m_ring->try_push(std::move(value));
+      });
+  }
+
+  // Ring 模式, 在锁内调用: 把缓冲区中的数据交给等待的 reader, 把等待的 writer 的数据放进缓冲区, 直到两边都不能继续。
+  // 缓冲区可能被不加锁的读写并发修改, 交接属于 select 的操作时先占住 select, 交接失败再撤销。
+  void transfer_waiters(CompletedWaiters<T>& completed) {
+    bool is_progressing = true;
+    while (is_progressing) {
+      is_progressing = false;
+      while (!m_reader_list.empty()) {
+        auto reader = m_reader_list.front();
+        if (reader->m_select) {
+          if (!reader->m_select->begin_claim(reader->m_select_index)) {
+            m_reader_list.pop_front();
+            m_waiting_reader_count.fetch_sub(1, std::memory_order_relaxed);
+            continue;
+          }
+          auto is_popped = m_ring->try_pop(reader->m_values[0]);
+          reader->m_select->end_claim(reader->m_select_index, is_popped);
+          if (!is_popped) {
+            break;
+          }
+          reader->m_count++;
+          is_progressing = true;
+        }
+        while (reader->remaining() > 0 && m_ring->try_pop(reader->m_values[reader->m_count])) {
+          reader->m_count++;
+          is_progressing = true;
+        }
+        if (!reader->is_satisfied()) {
+          break;
+        }
+        m_reader_list.pop_front();
+        m_waiting_reader_count.fetch_sub(1, std::memory_order_relaxed);
+        completed.add(reader);
+      }
+      while (!m_writer_list.empty()) {
+        auto writer = m_writer_list.front();
+        if (writer->m_select) {
+          if (!writer->m_select->begin_claim(writer->m_select_index)) {
+            m_writer_list.pop_front();
+            m_waiting_writer_count.fetch_sub(1, std::memory_order_relaxed);
+            continue;
+          }
+          auto is_pushed = push_to_ring(writer);
+          writer->m_select->end_claim(writer->m_select_index, is_pushed);
+          if (!is_pushed) {
+            break;
+          }
+          is_progressing = true;
+        }
+        while (writer->remaining() > 0 && push_to_ring(writer)) {
+          is_progressing = true;
+        }
+        if (writer->remaining() > 0) {
+          break;
+        }
+        m_writer_list.pop_front();
+        m_waiting_writer_count.fetch_sub(1, std::memory_order_relaxed);
+        completed.add(writer);
+      }
+    }
+  }
+  void transfer_waiters() {
+    std::unique_lock lock(m_mtx);
+    CompletedWaiters<T> completed;
+    transfer_waiters(completed);
+    lock.unlock();
+    completed.wake(nullptr, nullptr);
+  }
+
   std::mutex m_mtx;
   std::condition_variable m_cv;
 
-  std::queue<T> m_buffer;
-  unsigned long m_buffer_capacity;
-  std::list<ReaderAwaiter<T>*> m_reader_list;
-  std::list<WriterAwaiter<T>*> m_writer_list;     // 可以只存储指针的原因: 只在 read 之后才调用 writer 的 resume。这里的 list 是存入多个 producer 的 writer 的。
+  RingBuffer<T> m_buffer;
+  IntrusiveList<ChannelReadWaiter<T>> m_reader_list;    // 节点在等待的 awaiter 中 (协程帧里), 挂起和撤销都不分配内存
+  IntrusiveList<ChannelWriteWaiter<T>> m_writer_list;   // 可以只存储指针的原因: 只在 read 之后才调用 writer 的 resume。这里的 list 是存入多个 producer 的 writer 的。
+
+  // Ring 模式
+  std::unique_ptr<MpmcRing<T>> m_ring;
+  std::atomic<std::size_t> m_waiting_reader_count{0};   // 等待列表的长度, 不加锁的读写用来判断是否需要交接
+  std::atomic<std::size_t> m_waiting_writer_count{0};
 
   std::atomic<bool> m_is_active;
 };
@@ -1,65 +1,432 @@
 #pragma once
 
 #include <coroutine>
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <span>
+#include <thread>
+#include <type_traits>
 #include <utility>
 
 #include "executor.h"
 #include "channel.h"
 #include "common_awaiter.h"
+#include "ring_buffer.h"
 
 template<typename T>
 class Channel;
 
+// 在 executor 上恢复协程, 没有 executor 时直接恢复
+inline void dispatch_resume(AbstractExecutor* executor, std::coroutine_handle<> handle) {
+  if (executor) {
+    executor->execute([handle]() {
+        handle.resume();
+      });
+  } else {
+    handle.resume();
+  }
+}
+
+// 一次 select 中所有操作共享的状态。操作登记在各自 Channel 的等待列表中, Channel 在交接之前先抢占 (claim) select,
+// 只有第一个抢占成功的操作完成; 抢占失败的操作直接从等待列表中丢弃, 不会被唤醒, 由 select 自己撤销其余的登记。
+class SelectClaim {
+public:
+  static constexpr std::size_t kNone = std::numeric_limits<std::size_t>::max();
+  static constexpr std::size_t kBusy = kNone - 1;   // 正在尝试交接, 很快会确定或者撤销
+
+  // 交接一定成功时调用。已经被 index 抢占时也返回 true.
+  bool try_claim(std::size_t index) {
+    return claim_as(index, index);
+  }
+
+  // 交接可能失败时 (Ring 模式的缓冲区可以被并发修改) 先占住, 之后用 end_claim 确定或者撤销。
+  bool begin_claim(std::size_t index) {
+    return claim_as(index, kBusy);
+  }
+  void end_claim(std::size_t index, bool is_claimed) {
+    m_winner.store(is_claimed ? index : kNone, std::memory_order_release);
+  }
+
+  std::size_t winner() const {
+    return m_winner.load(std::memory_order_acquire);
+  }
+
+  // 胜出的操作和 select 的 await_suspend 各调用一次, 后到的恢复协程
+  void arrive() {
+    if (arrive_last()) {
+      dispatch_resume(m_executor, m_handle);
+    }
+  }
+  bool arrive_last() {
+    return m_gate.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+  std::coroutine_handle<> m_handle = nullptr;
+  AbstractExecutor* m_executor = nullptr;
+
+private:
+  // 占住的一方不会再等待其他东西, 所以这里等待它不会死锁
+  bool claim_as(std::size_t index, std::size_t target) {
+    auto winner = m_winner.load(std::memory_order_acquire);
+    while (true) {
+      if (winner == index) {
+        return true;
+      }
+      if (winner == kBusy) {
+        std::this_thread::yield();
+        winner = m_winner.load(std::memory_order_acquire);
+        continue;
+      }
+      if (winner != kNone) {
+        return false;
+      }
+      if (m_winner.compare_exchange_weak(winner, target, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return true;
+      }
+    }
+  }
+
+  std::atomic<std::size_t> m_winner{kNone};
+  std::atomic<int> m_gate{2};
+};
+
+// 属于 select 时先抢占 select, 否则总是成功
+template<typename Waiter>
+bool claim_waiter(Waiter* waiter) {
+  return !waiter->m_select || waiter->m_select->try_claim(waiter->m_select_index);
+}
+
+// Channel 等待列表中的读操作: 数据直接放进 m_values[m_count...], 读到 m_min_count 个以后才恢复,
+// 这之前还可以继续往里放, 直到 m_capacity 个。单个读取是容量为 1 的批量读取。
+template<typename T>
+struct ChannelReadWaiter {
+  std::size_t remaining() const {
+    return m_capacity - m_count;
+  }
+  bool is_satisfied() const {
+    return m_count >= m_min_count;
+  }
+
+  // 在锁外面调用, 恢复等待的协程
+  virtual void wake() = 0;
+
+  T* m_values = nullptr;
+  std::size_t m_capacity = 1;
+  std::size_t m_count = 0;
+  std::size_t m_min_count = 1;
+  ChannelReadWaiter* m_prev = nullptr;             // Channel 的等待列表 (IntrusiveList) 的节点, 挂起时不分配内存
+  ChannelReadWaiter* m_next = nullptr;
+  ChannelReadWaiter* m_next_completed = nullptr;   // Channel 在锁内收集完成的读操作, 在锁外面唤醒
+  SelectClaim* m_select = nullptr;                 // 只有单个读写可以用于 select
+  std::size_t m_select_index = 0;
+
+protected:
+  ~ChannelReadWaiter() = default;
+};
+
+// Channel 等待列表中的写操作: 从 m_values[m_written...] 取数据, 全部写完以后才恢复。
+// 值属于这个 writer 时 (m_movable_values 不为空) 交接时移动, 否则复制。
+template<typename T>
+struct ChannelWriteWaiter {
+  std::size_t remaining() const {
+    return m_count - m_written;
+  }
+
+  // 把接下来的 count 个值交给 dst
+  void take(std::size_t count, T* dst) {
+    if constexpr (std::is_copy_constructible_v<T>) {
+      if (!m_movable_values) {
+        copy_values(m_values + m_written, count, dst);
+        m_written += count;
+        return;
+      }
+    }
+    move_values(m_movable_values + m_written, count, dst);
+    m_written += count;
+  }
+
+  // 把下一个值交给 push (例如 MpmcRing::try_push), push 只在成功时才移动它
+  template<typename Push>
+  bool take_one(Push&& push) {
+    bool is_taken;
+    if constexpr (std::is_copy_constructible_v<T>) {
+      if (!m_movable_values) {
+        is_taken = push(T(m_values[m_written]));
+        m_written += is_taken;
+        return is_taken;
+      }
+    }
+    is_taken = push(std::move(m_movable_values[m_written]));
+    m_written += is_taken;
+    return is_taken;
+  }
+
+  virtual void wake() = 0;
+
+  const T* m_values = nullptr;
+  T* m_movable_values = nullptr;
+  std::size_t m_count = 1;
+  std::size_t m_written = 0;
+  ChannelWriteWaiter* m_prev = nullptr;
+  ChannelWriteWaiter* m_next = nullptr;
+  ChannelWriteWaiter* m_next_completed = nullptr;
+  SelectClaim* m_select = nullptr;
+  std::size_t m_select_index = 0;
+
+protected:
+  ~ChannelWriteWaiter() = default;
+};
+
+// 值在构造时复制 (左值) 或者移动 (右值, emplace 时直接构造) 进来, 之后每次交接都只移动一次。
 template<typename T>
-struct WriterAwaiter : public Awaiter<void> {
-  WriterAwaiter(Channel<T>* channel, T& value) : m_channel(channel), m_value(value) {}
+struct WriterAwaiter : public Awaiter<void>, public ChannelWriteWaiter<T> {
+  WriterAwaiter(Channel<T>* channel, const T& value) : m_channel(channel), m_value(value) {
+    own_value();
+  }
+  WriterAwaiter(Channel<T>* channel, T&& value) : m_channel(channel), m_value(std::move(value)) {
+    own_value();
+  }
+  template<typename... Args>
+  WriterAwaiter(Channel<T>* channel, std::in_place_t, Args&&... args)
+    : m_channel(channel), m_value(std::forward<Args>(args)...) {
+    own_value();
+  }
   WriterAwaiter(WriterAwaiter&& wa)
     : Awaiter<void>(wa),
+      ChannelWriteWaiter<T>(wa),
       m_channel(std::exchange(wa.m_channel, nullptr)),
-      m_value(wa.m_value) {}
+      m_value(std::move(wa.m_value)) {
+    own_value();
+  }
   ~WriterAwaiter() {
     if (m_channel) {
       m_channel->remove_writer(this);
     }
   }
 
+  // Ring 模式下缓冲区不满时直接写入, 不挂起
+  bool await_ready() {
+    if (!m_channel->try_write_buffered(this)) {
+      return false;
+    }
+    m_result = Result<void>();
+    return true;
+  }
+
   void suspend_helper() override {
-    m_channel->try_push_writer(this);
+    if (m_channel->try_push_writer(this)) {
+      resume();
+    }
+  }
+
+  // 从 Channel 的等待列表中移除。已经被 reader 取走时返回 false.
+  bool cancel() {
+    if (m_channel && m_channel->remove_writer(this)) {
+      m_channel = nullptr;
+      return true;
+    }
+    return false;
   }
 
   void resume_helper() override {
     m_channel->check_closed();
+    m_result = Result<void>();    // select 中完成时没有经过 resume()
     m_channel = nullptr;
   }
 
+  void wake() override {
+    if (this->m_select) {
+      this->m_select->arrive();
+    } else {
+      resume();
+    }
+  }
+
+  void own_value() {
+    this->m_values = &m_value;
+    this->m_movable_values = &m_value;
+  }
+
   Channel<T>* m_channel;
   T m_value;
 };
 
 template<typename T>
-struct ReaderAwaiter : public Awaiter<T> {
-  ReaderAwaiter(Channel<T>* channel) : m_channel(channel) {}
+struct ReaderAwaiter : public Awaiter<T>, public ChannelReadWaiter<T> {
+  ReaderAwaiter(Channel<T>* channel) : m_channel(channel) {
+    this->m_values = &m_value;
+  }
   ReaderAwaiter(ReaderAwaiter&& ra)
-    : Awaiter<T>(ra),
+    : Awaiter<T>(std::move(ra)),
+      ChannelReadWaiter<T>(ra),
       m_channel(std::exchange(ra.m_channel, nullptr)),
-      m_value_ptr(std::exchange(ra.m_value_ptr, nullptr)) {}
+      m_value_ptr(std::exchange(ra.m_value_ptr, nullptr)),
+      m_value(std::move(ra.m_value)) {
+    this->m_values = &m_value;
+  }
   ~ReaderAwaiter() {
     if (m_channel) {
       m_channel->remove_reader(this);
     }
   }
 
+  // Ring 模式下缓冲区不空时直接取出, 不挂起
+  bool await_ready() {
+    return m_channel->try_read_buffered(this);
+  }
+
   void suspend_helper() override {
-    m_channel->try_push_reader(this);
+    if (m_channel->try_push_reader(this)) {
+      this->resume_unsafe();
+    }
   }
-  void resume_helper() override {
+  // 从 Channel 的等待列表中移除。已经被 writer 取走时返回 false.
+  bool cancel() {
+    if (m_channel && m_channel->remove_reader(this)) {
+      m_channel = nullptr;
+      return true;
+    }
+    return false;
+  }
+  // 值直接从 m_value 移动出去, 不经过 m_result.
+  // 使用 >> 时值移动到 *m_value_ptr, 返回它的副本; T 只能移动时返回 T{}.
+  T await_resume() {
     m_channel->check_closed();
-    if (m_value_ptr) {
-      *m_value_ptr = this->m_result->get();
+    m_channel = nullptr;
+    if (!m_value_ptr) {
+      return std::move(m_value);
+    }
+    *m_value_ptr = std::move(m_value);
+    if constexpr (std::is_copy_constructible_v<T>) {
+      return *m_value_ptr;
+    } else {
+      return T{};
+    }
+  }
+
+  void wake() override {
+    if (this->m_select) {
+      this->m_select->arrive();
+    } else {
+      this->resume_unsafe();
+    }
+  }
+
+  Channel<T>* m_channel;
+  T* m_value_ptr = nullptr;
+  T m_value;
+};
+
+// co_await channel.write_many(values): 一次加锁尽量多地写入 (先交给等待的 reader, 再放进缓冲区), 全部写完才恢复。
+// 一次就能写完时不挂起。没有写完之前 Channel 被关闭时抛出 ChannelException.
+template<typename T>
+class WriteManyAwaiter : public ChannelWriteWaiter<T> {
+public:
+  WriteManyAwaiter(Channel<T>* channel, std::span<const T> values) : m_channel(channel) {
+    this->m_values = values.data();
+    this->m_count = values.size();
+  }
+  WriteManyAwaiter(WriteManyAwaiter&& wa)
+    : ChannelWriteWaiter<T>(wa),
+      m_channel(std::exchange(wa.m_channel, nullptr)),
+      m_executor(wa.m_executor) {}
+  ~WriteManyAwaiter() {
+    if (m_channel) {
+      m_channel->remove_writer(this);
+    }
+  }
+
+  void install_executor(AbstractExecutor* executor) {
+    m_executor = executor;
+  }
+
+  bool await_ready() {
+    return this->remaining() == 0 || m_channel->try_write_buffered(this);
+  }
+  bool await_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    return !m_channel->try_push_writer(this);
+  }
+  void await_resume() {
+    if (this->remaining() > 0) {
+      m_channel->check_closed();
     }
     m_channel = nullptr;
   }
 
+  bool cancel() {
+    if (m_channel && m_channel->remove_writer(this)) {
+      m_channel = nullptr;
+      return true;
+    }
+    return false;
+  }
+
+  void wake() override {
+    dispatch_resume(m_executor, m_handle);
+  }
+
+private:
+  Channel<T>* m_channel;
+  AbstractExecutor* m_executor = nullptr;
+  std::coroutine_handle<> m_handle = nullptr;
+};
+
+// n = co_await channel.read_many(values, min_count): 一次加锁尽量多地读取 (先从缓冲区, 再直接从等待的 writer),
+// 读到 min_count 个才恢复, 返回读到的数量 (不超过 values.size())。一次就能读够时不挂起。
+// Channel 被关闭时返回已经读到的数量, 一个也没有读到时抛出 ChannelException. 超时取消时已经读到的部分会丢失。
+template<typename T>
+class ReadManyAwaiter : public ChannelReadWaiter<T> {
+public:
+  ReadManyAwaiter(Channel<T>* channel, std::span<T> values, std::size_t min_count) : m_channel(channel) {
+    this->m_values = values.data();
+    this->m_capacity = values.size();
+    this->m_min_count = min_count;
+  }
+  ReadManyAwaiter(ReadManyAwaiter&& ra)
+    : ChannelReadWaiter<T>(ra),
+      m_channel(std::exchange(ra.m_channel, nullptr)),
+      m_executor(ra.m_executor) {}
+  ~ReadManyAwaiter() {
+    if (m_channel) {
+      m_channel->remove_reader(this);
+    }
+  }
+
+  void install_executor(AbstractExecutor* executor) {
+    m_executor = executor;
+  }
+
+  bool await_ready() {
+    return this->remaining() == 0 || m_channel->try_read_buffered(this);
+  }
+  bool await_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    return !m_channel->try_push_reader(this);
+  }
+  std::size_t await_resume() {
+    if (!this->is_satisfied() && this->m_count == 0) {
+      m_channel->check_closed();
+    }
+    m_channel = nullptr;
+    return this->m_count;
+  }
+
+  bool cancel() {
+    if (m_channel && m_channel->remove_reader(this)) {
+      m_channel = nullptr;
+      return true;
+    }
+    return false;
+  }
+
+  void wake() override {
+    dispatch_resume(m_executor, m_handle);
+  }
+
+private:
   Channel<T>* m_channel;
-  T* m_value_ptr;
+  AbstractExecutor* m_executor = nullptr;
+  std::coroutine_handle<> m_handle = nullptr;
 };
@@ -1,12 +1,13 @@
 #pragma once
 
 #include <coroutine>
-#include <functional>
 #include <optional>
 #include <exception>
+#include <utility>
 
 #include "executor.h"
 #include "result.h"
+#include "unique_function.h"
 
 template<typename T>
 class Awaiter {
@@ -20,7 +21,7 @@ public:
   }
   T await_resume() {
     resume_helper();
-    return m_result->get();
+    return std::move(*m_result).get();
   }
 
   void install_executor(AbstractExecutor* executor) {
@@ -28,8 +29,8 @@ public:
   }
 
   void resume(T value) {
-    dispatch([this, value]() {
-      m_result = Result<T>(static_cast<T>(value));
+    dispatch([this, value = std::move(value)]() mutable {
+      m_result = Result<T>(std::move(value));
       m_handle.resume();
       });
   }
@@ -39,8 +40,8 @@ public:
       });
   }
   void resume_exception(std::exception_ptr&& e) {
-    dispatch([this, e]() {
-      m_result = Result<T>(static_cast<T>(e));
+    dispatch([this, e = std::move(e)]() {
+      m_result = Result<T>(e);
       m_handle.resume();
       });
   }
@@ -49,15 +50,15 @@ protected:
   virtual void resume_helper() {}
   virtual void suspend_helper() {}
   std::optional<Result<T>> m_result;
+  AbstractExecutor* m_executor = nullptr;
 private:
-  void dispatch(std::function<void()>&& func) {
+  void dispatch(UniqueFunction<void()>&& func) {
     if (m_executor) {
       m_executor->execute(std::move(func));
     } else {
       func();
     }
   }
-  AbstractExecutor* m_executor = nullptr;
   std::coroutine_handle<> m_handle = nullptr;
 };
 
@@ -87,24 +88,30 @@ public:
       });
   }
   void resume_exception(std::exception_ptr&& e) {
-    dispatch([this, e]() {
+    dispatch([this, e = std::move(e)]() {
       m_result = Result<void>(e);
       m_handle.resume();
       });
   }
 
 protected:
+  // 已经在 m_executor 的线程上时直接恢复, 不再经过 Executor 的队列。
+  void resume_inline() {
+    m_result = Result<void>();
+    m_handle.resume();
+  }
+
   virtual void resume_helper() {}
   virtual void suspend_helper() {}
   std::optional<Result<void>> m_result;
+  AbstractExecutor* m_executor = nullptr;
 private:
-  void dispatch(std::function<void()>&& func) {
+  void dispatch(UniqueFunction<void()>&& func) {
     if (m_executor) {
       m_executor->execute(std::move(func));
     } else {
       func();
     }
   }
-  AbstractExecutor* m_executor = nullptr;
   std::coroutine_handle<> m_handle = nullptr;
 };
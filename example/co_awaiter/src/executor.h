@@ -1,39 +1,179 @@
 #pragma once
 
-#include <functional>
-#include <future>
+#include <algorithm>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include "mpsc_queue.h"
+#include "unique_function.h"
+#include "scheduler.h"
 
 struct AbstractExecutor {
-  virtual void execute(std::function<void()>&& func) = 0;
+  virtual void execute(UniqueFunction<void()>&& func) = 0;
+
+  // delay 之后在这个 Executor 的线程上执行 func.
+  // 默认由 shared_scheduler() 计时, 到期后再通过 execute 提交; 有自己的定时器的 Executor 会覆盖它。
+  virtual TimerHandle execute_after(UniqueFunction<void()>&& func, std::chrono::nanoseconds delay) {
+    return shared_scheduler().execute([guard = m_timer_guard, func = std::move(func)]() mutable {
+        std::lock_guard lg(guard->m_mtx);
+        if (guard->m_executor) {
+          guard->m_executor->execute(std::move(func));
+        }
+      }, delay);
+  }
+
+protected:
+  // 使用默认的 execute_after 的 Executor 在析构函数的开头调用 (这时 execute 还可以调用):
+  // 等正在提交的定时器提交完, 之后到期的定时器直接丢弃回调, 不再访问这个 Executor.
+  void detach_shared_timers() {
+    std::lock_guard lg(m_timer_guard->m_mtx);
+    m_timer_guard->m_executor = nullptr;
+  }
+
+private:
+  // shared_scheduler() 中的定时器持有它, 而不是直接持有 Executor, 所以可以比 Executor 活得久。
+  struct TimerGuard {
+    explicit TimerGuard(AbstractExecutor* executor) : m_executor(executor) {}
+    std::mutex m_mtx;
+    AbstractExecutor* m_executor;
+  };
+  std::shared_ptr<TimerGuard> m_timer_guard = std::make_shared<TimerGuard>(this);
 };
 
+// 同一种 Executor 的所有 Task 共享一个实例, 而不是每个协程帧都创建自己的 Executor (和线程)。
+// 先创建 shared_scheduler(), 让它在所有共享的 Executor 之后析构: Executor 析构时会等待自己的线程结束,
+// 这些线程上的任务在这之前仍然可以使用 shared_scheduler().
+template<typename Executor>
+Executor& shared_executor() {
+  shared_scheduler();
+  static Executor executor;
+  return executor;
+}
+
 struct NoopExecutor : public AbstractExecutor {
-  void execute(std::function<void()>&& func) override {
+  ~NoopExecutor() {
+    detach_shared_timers();
+  }
+
+  void execute(UniqueFunction<void()>&& func) override {
     func();
   }
 };
 
-struct AsyncExecutor : public AbstractExecutor {
-  void execute(std::function<void()>&& func) override {
-    auto future = std::async(std::move(func));
+// 任务总是在其他线程上运行。
+// Cached 模式下复用空闲线程, 不够时创建新线程 (最多 max_thread_count 个), 线程空闲超过 idle_timeout 后退出。
+class NewThreadExecutor : public AbstractExecutor {
+public:
+  enum class Mode {
+    Detached,   // 每次 execute 都创建并 detach 一个新线程
+    Cached,
+  };
+
+  explicit NewThreadExecutor(Mode mode = Mode::Cached,
+                             unsigned int max_thread_count = 256,
+                             std::chrono::milliseconds idle_timeout = std::chrono::seconds(60))
+    : m_mode(mode), m_max_thread_count(max_thread_count ? max_thread_count : 1), m_idle_timeout(idle_timeout) {}
+  ~NewThreadExecutor() {
+    detach_shared_timers();
+    std::unique_lock lock(m_mtx);
+    m_is_active = false;
+    decltype(m_queue) empty_queue;
+    std::swap(m_queue, empty_queue);
+    m_cv.notify_all();
+    m_exit_cv.wait(lock, [this]() { return m_thread_count == 0; });
+  }
+
+  void execute(UniqueFunction<void()>&& func) override {
+    if (m_mode == Mode::Detached) {
+      std::thread(std::move(func)).detach();
+      return;
+    }
+
+    std::unique_lock lock(m_mtx);
+    if (!m_is_active) {
+      return;
+    }
+    m_queue.push(std::move(func));
+    if (m_queue.size() > m_idle_count && m_thread_count < m_max_thread_count) {
+      m_thread_count++;
+      std::thread(&NewThreadExecutor::run_loop, this).detach();
+    } else {
+      // 持有锁时通知, 否则析构函数可能在通知之前销毁 m_cv
+      m_cv.notify_one();
+    }
   }
-};
 
-struct NewThreadExecutor : public AbstractExecutor {
-  void execute(std::function<void()>&& func) override {
-    std::thread(std::move(func)).detach();
+  unsigned int thread_count() {
+    std::lock_guard lg(m_mtx);
+    return m_thread_count;
   }
+
+private:
+  void run_loop() {
+    std::unique_lock lock(m_mtx);
+    while (true) {
+      if (!m_queue.empty()) {
+        auto func = std::move(m_queue.front());
+        m_queue.pop();
+        lock.unlock();
+        func();
+        func = nullptr;
+        lock.lock();
+        continue;
+      }
+      if (!m_is_active) {
+        break;
+      }
+      m_idle_count++;
+      bool has_task = m_cv.wait_for(lock, m_idle_timeout, [this]() {
+          return !m_queue.empty() || !m_is_active;
+        });
+      m_idle_count--;
+      if (!has_task) {
+        break;    // 空闲超时, 线程退出
+      }
+    }
+    m_thread_count--;
+    m_exit_cv.notify_all();
+  }
+
+  Mode m_mode;
+  unsigned int m_max_thread_count;
+  std::chrono::milliseconds m_idle_timeout;
+
+  std::mutex m_mtx;
+  std::condition_variable m_cv;
+  std::condition_variable m_exit_cv;
+  std::queue<UniqueFunction<void()>> m_queue;
+  std::size_t m_idle_count = 0;
+  unsigned int m_thread_count = 0;
+  bool m_is_active = true;
 };
 
 class LooperExecutor : public AbstractExecutor {
 public:
-  LooperExecutor() {
+  enum class QueueMode {
+    Mutex,      // std::queue + mutex + condition_variable
+    LockFree,   // MpscQueue, 队列为空时才通过 atomic::wait 阻塞
+  };
+
+  explicit LooperExecutor(QueueMode mode = QueueMode::Mutex) : m_queue_mode(mode) {
     m_is_active.store(true, std::memory_order_relaxed);
-    m_work_thread = std::thread(&LooperExecutor::run_loop, this);
+    if (m_queue_mode == QueueMode::LockFree) {
+      m_work_thread = std::thread(&LooperExecutor::run_lock_free_loop, this);
+    } else {
+      m_work_thread = std::thread(&LooperExecutor::run_loop, this);
+    }
   }
   ~LooperExecutor() {
+    detach_shared_timers();
     shutdown(false);
     if (m_work_thread.joinable()) {
       m_work_thread.join();
@@ -41,16 +181,23 @@ public:
   }
 
   void run_loop() {
+    s_current_executor = this;
     // `!executor_queue.empty()` 为了 does_wait_for_complete = true.
     while (m_is_active.load(std::memory_order_relaxed) || !m_executor_queue.empty()) {
+      m_timers.run_expired();
       std::unique_lock lock(m_queue_mutex);
       if (m_executor_queue.empty()) {
-        m_queue_cv.wait(lock);
+        auto deadline = m_timers.next_deadline();
+        if (deadline == TimerShard::kNoDeadline) {
+          m_queue_cv.wait(lock);
+        } else {
+          m_queue_cv.wait_until(lock, to_time_point(deadline));
+        }
         if (m_executor_queue.empty()) {
           continue;
         }
       }
-      auto func = m_executor_queue.front();
+      auto func = std::move(m_executor_queue.front());
       m_executor_queue.pop();
       lock.unlock();
 
@@ -58,8 +205,34 @@ public:
     }
   }
 
-  void execute(std::function<void()>&& func) override {
+  void run_lock_free_loop() {
+    UniqueFunction<void()> func;
+    while (true) {
+      if (m_lock_free_queue.try_pop(func)) {
+        if (!m_does_discard_pending.load(std::memory_order_relaxed)) {
+          func();
+        }
+        func = nullptr;
+        continue;
+      }
+      if (!m_is_active.load(std::memory_order_relaxed)
+          && (m_lock_free_queue.empty() || m_does_discard_pending.load(std::memory_order_relaxed))) {
+        break;
+      }
+      if (m_lock_free_queue.empty()) {
+        m_lock_free_queue.wait(m_is_active);
+      } else {
+        std::this_thread::yield();    // 生产者还没链接好节点
+      }
+    }
+  }
+
+  void execute(UniqueFunction<void()>&& func) override {
     if (m_is_active.load(std::memory_order_relaxed)) {
+      if (m_queue_mode == QueueMode::LockFree) {
+        m_lock_free_queue.push(std::move(func));
+        return;
+      }
       std::unique_lock lock(m_queue_mutex);
       m_executor_queue.push(std::move(func));
       lock.unlock();
@@ -67,7 +240,39 @@ public:
     }
   }
 
+  // Mutex 模式下定时器由 run_loop 自己计时, 到期后直接在工作线程上执行。
+  // LockFree 模式的 run_lock_free_loop 不能带超时地等待, 仍然使用 shared_scheduler().
+  TimerHandle execute_after(UniqueFunction<void()>&& func, std::chrono::nanoseconds delay) override {
+    if (m_queue_mode == QueueMode::LockFree) {
+      return AbstractExecutor::execute_after(std::move(func), delay);
+    }
+    if (!m_is_active.load(std::memory_order_relaxed)) {
+      return {};
+    }
+    bool is_earliest;
+    auto handle = m_timers.add(std::move(func), delay, is_earliest);
+    if (is_earliest && s_current_executor != this) {
+      std::lock_guard lg(m_queue_mutex);
+      m_queue_cv.notify_one();
+    }
+    return handle;
+  }
+
+  // Mutex 模式下自己触发的定时器的延迟
+  TimerLag timer_lag() const {
+    return m_timers.timer_lag();
+  }
+
   void shutdown(bool does_wait_for_complete=true) {
+    if (m_queue_mode == QueueMode::LockFree) {
+      m_is_active.store(false);
+      // 只有消费者线程可以出队, 由 run_lock_free_loop 丢弃剩余的任务。
+      if (!does_wait_for_complete) {
+        m_does_discard_pending.store(true, std::memory_order_relaxed);
+      }
+      m_lock_free_queue.notify();
+      return;
+    }
     m_is_active.store(false, std::memory_order_relaxed);
     if (!does_wait_for_complete) {
       std::lock_guard lg(m_queue_mutex);
@@ -77,10 +282,220 @@ public:
     m_queue_cv.notify_all();
   }
 private:
-  std::queue<std::function<void()>> m_executor_queue;
+  QueueMode m_queue_mode;
+
+  std::queue<UniqueFunction<void()>> m_executor_queue;
   std::mutex m_queue_mutex;
   std::condition_variable m_queue_cv;
+  TimerShard m_timers;              // 退出时还没有触发的定时器直接丢弃
+
+  MpscQueue<UniqueFunction<void()>> m_lock_free_queue;
+  std::atomic<bool> m_does_discard_pending{false};
 
   std::atomic<bool> m_is_active;    // 用于 run_loop 的自动退出和 shutdown
   std::thread m_work_thread;
+
+  static inline thread_local LooperExecutor* s_current_executor = nullptr;
+};
+
+struct LockFreeLooperExecutor : public LooperExecutor {
+  LockFreeLooperExecutor() : LooperExecutor(QueueMode::LockFree) {}
+};
+
+// 每个工作线程一个双端队列: 本线程从尾部 push/pop (LIFO), 空闲的线程从其他队列头部窃取 (FIFO)。
+// 每个工作线程还有自己的定时器, 工作线程上设置的定时器在同一个线程上到期执行。
+class WorkStealingExecutor : public AbstractExecutor {
+public:
+  explicit WorkStealingExecutor(unsigned int thread_count = std::thread::hardware_concurrency()) {
+    thread_count = thread_count ? thread_count : 1;
+    m_is_active.store(true, std::memory_order_relaxed);
+    for (unsigned int i = 0; i < thread_count; i++) {
+      m_workers.emplace_back(std::make_unique<Worker>());
+    }
+    for (unsigned int i = 0; i < thread_count; i++) {
+      m_workers[i]->m_thread = std::thread(&WorkStealingExecutor::run_loop, this, i);
+    }
+  }
+  ~WorkStealingExecutor() {
+    shutdown(false);
+    for (auto& worker : m_workers) {
+      if (worker->m_thread.joinable()) {
+        worker->m_thread.join();
+      }
+    }
+  }
+
+  void run_loop(std::size_t index) {
+    s_current_executor = this;
+    s_current_index = index;
+
+    auto& timers = m_workers[index]->m_timers;
+    UniqueFunction<void()> func;
+    while (true) {
+      timers.run_expired();
+      if (pop_local(index, func) || steal(index, func)) {
+        func();
+        func = nullptr;
+        continue;
+      }
+      if (steal_timers(index)) {
+        continue;
+      }
+
+      std::unique_lock lock(m_idle_mutex);
+      if (!m_is_active.load(std::memory_order_relaxed) && m_pending_count.load() == 0) {
+        break;
+      }
+      m_idle_count.fetch_add(1);
+      // 等到所有工作线程中最早的定时器, 它的所属线程可能正忙。有更早的定时器加入时也要醒来, 重新计算等待时间
+      auto deadline = next_deadline();
+      auto is_ready = [this, deadline]() {
+          return m_pending_count.load() > 0 || !m_is_active.load(std::memory_order_relaxed)
+            || next_deadline() < deadline;
+        };
+      if (deadline == TimerShard::kNoDeadline) {
+        m_idle_cv.wait(lock, is_ready);
+      } else {
+        m_idle_cv.wait_until(lock, to_time_point(deadline), is_ready);
+      }
+      m_idle_count.fetch_sub(1);
+    }
+  }
+
+  void execute(UniqueFunction<void()>&& func) override {
+    if (!m_is_active.load(std::memory_order_relaxed)) {
+      return;
+    }
+
+    // 工作线程提交到自己的队列, 外部线程轮流提交到各个队列。
+    std::size_t index = s_current_executor == this
+      ? s_current_index
+      : m_next_index.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+    {
+      std::lock_guard lg(m_workers[index]->m_mtx);
+      m_workers[index]->m_deque.push_back(std::move(func));
+    }
+
+    // 先增加 pending 再读取 idle, 与 run_loop 中的顺序相反, 不会丢失唤醒。
+    m_pending_count.fetch_add(1);
+    if (m_idle_count.load() > 0) {
+      std::lock_guard lg(m_idle_mutex);
+      m_idle_cv.notify_one();
+    }
+  }
+
+  // 工作线程设置的定时器由它自己计时, 外部线程轮流设置到各个工作线程。
+  // 所属的工作线程在执行阻塞的任务时, 到期的定时器由空闲的工作线程代为触发 (steal_timers)。
+  TimerHandle execute_after(UniqueFunction<void()>&& func, std::chrono::nanoseconds delay) override {
+    if (!m_is_active.load(std::memory_order_relaxed)) {
+      return {};
+    }
+
+    bool is_local = s_current_executor == this;
+    std::size_t index = is_local
+      ? s_current_index
+      : m_next_index.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+    bool is_earliest;
+    auto handle = m_workers[index]->m_timers.add(std::move(func), delay, is_earliest);
+    if (is_earliest && (!is_local || m_idle_count.load() > 0)) {
+      // 空闲的工作线程等待的是所有工作线程中最早的定时器, 它们在同一个条件变量上等待, 只能全部唤醒
+      std::lock_guard lg(m_idle_mutex);
+      m_idle_cv.notify_all();
+    }
+    return handle;
+  }
+
+  // 所有工作线程触发的定时器的延迟
+  TimerLag timer_lag() const {
+    TimerLag lag;
+    for (auto& worker : m_workers) {
+      lag += worker->m_timers.timer_lag();
+    }
+    return lag;
+  }
+
+  void shutdown(bool does_wait_for_complete=true) {
+    m_is_active.store(false, std::memory_order_relaxed);
+    if (!does_wait_for_complete) {
+      for (auto& worker : m_workers) {
+        std::lock_guard lg(worker->m_mtx);
+        m_pending_count.fetch_sub(worker->m_deque.size());
+        worker->m_deque.clear();
+      }
+    }
+    std::lock_guard lg(m_idle_mutex);
+    m_idle_cv.notify_all();
+  }
+
+private:
+  struct Worker {
+    std::mutex m_mtx;
+    std::deque<UniqueFunction<void()>> m_deque;
+    TimerShard m_timers;              // 退出时还没有触发的定时器直接丢弃
+    std::thread m_thread;
+  };
+
+  bool pop_local(std::size_t index, UniqueFunction<void()>& func) {
+    auto& worker = *m_workers[index];
+    std::lock_guard lg(worker.m_mtx);
+    if (worker.m_deque.empty()) {
+      return false;
+    }
+    func = std::move(worker.m_deque.back());
+    worker.m_deque.pop_back();
+    m_pending_count.fetch_sub(1);
+    return true;
+  }
+
+  bool steal(std::size_t index, UniqueFunction<void()>& func) {
+    for (std::size_t i = 1; i < m_workers.size(); i++) {
+      auto& victim = *m_workers[(index + i) % m_workers.size()];
+      std::lock_guard lg(victim.m_mtx);
+      if (!victim.m_deque.empty()) {
+        func = std::move(victim.m_deque.front());
+        victim.m_deque.pop_front();
+        m_pending_count.fetch_sub(1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // 没有任务可以执行时, 替其他 (可能正在执行阻塞的任务的) 工作线程触发到期的定时器
+  bool steal_timers(std::size_t index) {
+    auto& timers = m_workers[index]->m_timers;
+    bool has_expired = false;
+    for (std::size_t i = 1; i < m_workers.size(); i++) {
+      has_expired |= timers.run_expired_for(m_workers[(index + i) % m_workers.size()]->m_timers);
+    }
+    return has_expired;
+  }
+
+  long long next_deadline() const {
+    auto deadline = TimerShard::kNoDeadline;
+    for (auto& worker : m_workers) {
+      deadline = std::min(deadline, worker->m_timers.next_deadline());
+    }
+    return deadline;
+  }
+
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::atomic<std::size_t> m_next_index{0};
+
+  std::atomic<long long> m_pending_count{0};
+  std::atomic<int> m_idle_count{0};
+  std::mutex m_idle_mutex;
+  std::condition_variable m_idle_cv;
+
+  std::atomic<bool> m_is_active;
+
+  static inline thread_local WorkStealingExecutor* s_current_executor = nullptr;
+  static inline thread_local std::size_t s_current_index = 0;
+};
+
+// std::async 返回的 future 析构时会阻塞, 而且可能每次都创建线程。
+// 这里改为使用固定数量的预先创建好的线程, execute 立即返回。
+struct AsyncExecutor : public WorkStealingExecutor {
+  explicit AsyncExecutor(unsigned int thread_count = std::thread::hardware_concurrency())
+    : WorkStealingExecutor(thread_count) {}
 };
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <ostream>
+#include <string_view>
+#include <typeinfo>
+#include <utility>
+
+// 用户可以提供自己的内存池, 通过 FrameAllocator::set_arena 设置。
+struct FrameArena {
+  virtual ~FrameArena() = default;
+  virtual void* allocate(std::size_t size) = 0;
+  virtual void deallocate(void* ptr, std::size_t size) = 0;
+};
+
+// 协程帧的内存分配: 按 64 字节分级, 每个线程一组空闲链表, 释放的帧留给下一个同样大小的协程使用。
+// 每个帧前面有一个 16 字节的头, 记录它来自哪个 FrameArena (nullptr 表示来自空闲链表或 ::operator new)。
+class FrameAllocator {
+public:
+  static constexpr std::size_t kClassSize = 64;
+  static constexpr std::size_t kClassCount = 32;          // 缓存不超过 2048 字节的帧
+  static constexpr std::size_t kMaxCachedPerClass = 1024;
+
+  // Promise 是协程的 promise 类型, 只用于统计: 打开统计时按 promise 类型分别记录分配次数和帧大小。
+  template<typename Promise>
+  static void* allocate(std::size_t size) {
+    if (s_is_stats_enabled.load(std::memory_order_relaxed)) {
+      record(size);
+      type_stats<Promise>().record(size);
+    }
+    return allocate_block(size);
+  }
+
+  static void deallocate(void* ptr, std::size_t size) {
+    void* block = static_cast<char*>(ptr) - kHeaderSize;
+    auto arena = static_cast<Header*>(block)->m_arena;
+    if (arena) {
+      arena->deallocate(block, size + kHeaderSize);
+      return;
+    }
+
+    auto index = class_index(size);
+    auto cache = thread_cache();
+    if (index < kClassCount && cache && cache->m_counts[index] < kMaxCachedPerClass) {
+      auto node = ::new (block) FreeNode{cache->m_free_lists[index]};
+      cache->m_free_lists[index] = node;
+      cache->m_counts[index]++;
+    } else {
+      ::operator delete(block);
+    }
+  }
+
+  // 之后创建的协程帧从 arena 分配, 传入 nullptr 恢复默认的分配方式。
+  static void set_arena(FrameArena* arena) {
+    s_arena.store(arena, std::memory_order_release);
+  }
+
+  static void set_stats_enabled(bool enabled) {
+    s_is_stats_enabled.store(enabled, std::memory_order_relaxed);
+  }
+
+  // 按帧大小 (16 字节对齐) 输出分配次数, 用来找出哪些协程的帧比较大。
+  static void dump_stats(std::ostream& os) {
+    os << "coroutine frame sizes (bytes: count)" << std::endl;
+    for (std::size_t i = 0; i < kTrackedBucketCount; i++) {
+      auto count = s_size_counts[i].load(std::memory_order_relaxed);
+      if (count) {
+        os << "  " << i * kTrackedGranularity << "-" << (i + 1) * kTrackedGranularity - 1 << ": " << count << std::endl;
+      }
+    }
+    auto large_count = s_size_counts[kTrackedBucketCount].load(std::memory_order_relaxed);
+    if (large_count) {
+      os << "  >=" << kTrackedBucketCount * kTrackedGranularity << ": " << large_count << std::endl;
+    }
+    os << "  max: " << s_max_size.load(std::memory_order_relaxed) << std::endl;
+
+    // 同一个 promise 类型的协程函数可能有多个, 帧大小不同, 所以同时输出平均值和最大值
+    os << "coroutine frames by promise type (count, avg bytes, max bytes)" << std::endl;
+    for (auto stats = s_type_stats.load(std::memory_order_acquire); stats; stats = stats->m_next) {
+      auto count = stats->m_count.load(std::memory_order_relaxed);
+      if (count) {
+        os << "  " << stats->m_name << ": " << count << ", " << stats->m_bytes.load(std::memory_order_relaxed) / count
+           << ", " << stats->m_max_size.load(std::memory_order_relaxed) << std::endl;
+      }
+    }
+  }
+
+private:
+  // 每个 promise 类型一个, 第一次分配时创建并加入 s_type_stats 链表, 之后不会删除。
+  struct TypeStats {
+    explicit TypeStats(std::string_view name) : m_name(name) {
+      m_next = s_type_stats.load(std::memory_order_relaxed);
+      while (!s_type_stats.compare_exchange_weak(m_next, this, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    void record(std::size_t size) {
+      m_count.fetch_add(1, std::memory_order_relaxed);
+      m_bytes.fetch_add(size, std::memory_order_relaxed);
+      auto max_size = m_max_size.load(std::memory_order_relaxed);
+      while (size > max_size && !m_max_size.compare_exchange_weak(max_size, size, std::memory_order_relaxed)) {}
+    }
+
+    std::string_view m_name;
+    TypeStats* m_next;
+    std::atomic<std::size_t> m_count{0};
+    std::atomic<std::size_t> m_bytes{0};
+    std::atomic<std::size_t> m_max_size{0};
+  };
+
+  // GCC 和 Clang 上类型名取自 __PRETTY_FUNCTION__ 中的 "Promise = ...", 比 typeid(Promise).name() 可读;
+  // 其他编译器 (例如 MSVC 只有 __FUNCSIG__, 格式不同) 使用 typeid(Promise).name().
+  template<typename Promise>
+  static TypeStats& type_stats() {
+#if defined(__GNUC__) || defined(__clang__)
+    static TypeStats stats(type_name(__PRETTY_FUNCTION__));
+#else
+    static TypeStats stats(typeid(Promise).name());
+#endif
+    return stats;
+  }
+
+  static std::string_view type_name(std::string_view pretty_function) {
+    auto begin = pretty_function.find("Promise = ");
+    if (begin == std::string_view::npos) {
+      return pretty_function;
+    }
+    auto name = pretty_function.substr(begin + 10);
+    return name.substr(0, std::min(name.find(';'), name.rfind(']')));
+  }
+
+  static void* allocate_block(std::size_t size) {
+    auto arena = s_arena.load(std::memory_order_acquire);
+    void* block = nullptr;
+    if (arena) {
+      block = arena->allocate(size + kHeaderSize);
+    } else {
+      auto index = class_index(size);
+      auto cache = thread_cache();
+      if (index < kClassCount && cache && cache->m_free_lists[index]) {
+        auto node = cache->m_free_lists[index];
+        cache->m_free_lists[index] = node->m_next;
+        cache->m_counts[index]--;
+        block = node;
+      } else {
+        block = ::operator new(index < kClassCount ? (index + 1) * kClassSize + kHeaderSize : size + kHeaderSize);
+      }
+    }
+    ::new (block) Header{arena};
+    return static_cast<char*>(block) + kHeaderSize;
+  }
+
+  struct Header {
+    FrameArena* m_arena;
+  };
+  static constexpr std::size_t kHeaderSize = alignof(std::max_align_t);
+  static_assert(sizeof(Header) <= kHeaderSize);
+
+  struct FreeNode {
+    FreeNode* m_next;
+  };
+
+  struct ThreadCache {
+    FreeNode* m_free_lists[kClassCount] = {};
+    std::size_t m_counts[kClassCount] = {};
+  };
+
+  // 线程退出时释放空闲链表。s_thread_cache 是 trivially destructible 的,
+  // 线程退出之后 (例如静态对象析构时) 再释放的帧直接交给 ::operator delete.
+  struct ThreadCacheOwner {
+    ThreadCacheOwner() {
+      s_thread_cache = &m_cache;
+    }
+    ~ThreadCacheOwner() {
+      s_thread_cache = nullptr;
+      for (auto head : m_cache.m_free_lists) {
+        while (head) {
+          ::operator delete(std::exchange(head, head->m_next));
+        }
+      }
+    }
+    ThreadCache m_cache;
+  };
+
+  static std::size_t class_index(std::size_t size) {
+    return (size + kClassSize - 1) / kClassSize - 1;
+  }
+
+  // 线程第一次分配时创建; 线程退出后返回 nullptr.
+  static ThreadCache* thread_cache() {
+    if (!s_thread_cache) {
+      static thread_local ThreadCacheOwner owner;
+    }
+    return s_thread_cache;
+  }
+
+  static void record(std::size_t size) {
+    auto bucket = size / kTrackedGranularity;
+    s_size_counts[bucket < kTrackedBucketCount ? bucket : kTrackedBucketCount].fetch_add(1, std::memory_order_relaxed);
+    auto max_size = s_max_size.load(std::memory_order_relaxed);
+    while (size > max_size && !s_max_size.compare_exchange_weak(max_size, size, std::memory_order_relaxed)) {}
+  }
+
+  static constexpr std::size_t kTrackedGranularity = 16;
+  static constexpr std::size_t kTrackedBucketCount = 256;
+
+  static inline std::atomic<FrameArena*> s_arena{nullptr};
+  static inline std::atomic<bool> s_is_stats_enabled{false};
+  static inline std::atomic<std::size_t> s_size_counts[kTrackedBucketCount + 1] = {};
+  static inline std::atomic<std::size_t> s_max_size{0};
+  static inline std::atomic<TypeStats*> s_type_stats{nullptr};
+  static inline thread_local ThreadCache* s_thread_cache = nullptr;
+};
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <future>
+#include <memory>
+#include <atomic>
+#include <thread>
 
 #include "common_awaiter.h"
 
@@ -13,13 +16,29 @@ public:
   FutureAwaiter(FutureAwaiter&& awaiter) = default;
   FutureAwaiter& operator=(const FutureAwaiter&) = delete;
   
+  // 不再等待 future. 等待的线程拿到结果后直接丢弃, 不会再访问这个 awaiter. 已经拿到结果时返回 false.
+  bool cancel() {
+    return !m_is_claimed->exchange(true);
+  }
+
 protected:
   void suspend_helper() override {
-    std::thread([this]() {
-        this->resume(this->m_future.get());
+    std::thread([this, future = std::move(m_future), is_claimed = m_is_claimed]() mutable {
+        try {
+          auto value = future.get();
+          if (!is_claimed->exchange(true)) {
+            this->resume(std::move(value));
+          }
+        } catch (...) {
+          // future 中的异常在协程恢复后由 await_resume 抛出
+          if (!is_claimed->exchange(true)) {
+            this->resume_exception(std::current_exception());
+          }
+        }
       }).detach();
   }
   
 private:
   std::future<T> m_future;
+  std::shared_ptr<std::atomic<bool>> m_is_claimed = std::make_shared<std::atomic<bool>>(false);   // 恢复或取消, 只有一个能成功
 };
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <utility>
+
+// 侵入式双向链表: 节点 (Node) 自己带 m_prev/m_next 指针, 链表只记录首尾, 加入和删除都不分配内存。
+// 一个节点同一时间只能在一个链表中。不是线程安全的, 由所有者加锁访问。
+template<typename Node>
+class IntrusiveList {
+public:
+  IntrusiveList() = default;
+  IntrusiveList(IntrusiveList&& other)
+    : m_head(std::exchange(other.m_head, nullptr)),
+      m_tail(std::exchange(other.m_tail, nullptr)) {}
+  IntrusiveList(const IntrusiveList&) = delete;
+  IntrusiveList& operator=(const IntrusiveList&) = delete;
+
+  bool empty() const {
+    return !m_head;
+  }
+  Node* front() const {
+    return m_head;
+  }
+
+  void push_back(Node* node) {
+    node->m_prev = m_tail;
+    node->m_next = nullptr;
+    if (m_tail) {
+      m_tail->m_next = node;
+    } else {
+      m_head = node;
+    }
+    m_tail = node;
+  }
+
+  Node* pop_front() {
+    auto node = m_head;
+    erase(node);
+    return node;
+  }
+
+  // 节点不在这个链表中时返回 false
+  bool erase(Node* node) {
+    if (!contains(node)) {
+      return false;
+    }
+    if (node->m_prev) {
+      node->m_prev->m_next = node->m_next;
+    } else {
+      m_head = node->m_next;
+    }
+    if (node->m_next) {
+      node->m_next->m_prev = node->m_prev;
+    } else {
+      m_tail = node->m_prev;
+    }
+    node->m_prev = nullptr;
+    node->m_next = nullptr;
+    return true;
+  }
+
+  // 不在链表中的节点 m_prev 为空, 只有首节点例外
+  bool contains(const Node* node) const {
+    return node->m_prev || m_head == node;
+  }
+
+private:
+  Node* m_head = nullptr;
+  Node* m_tail = nullptr;
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+
+#include "task_promise.h"
+#include "common_awaiter.h"
+
+template<typename T>
+class LazyTask;
+
+template<typename T>
+class LazyTaskAwaiter;
+
+// 创建时不运行 (suspend_always), 由第一次 co_await 或者 get_result 开始运行。
+// 没有自己的 Executor, 使用等待它的协程的 Executor. Promise 是派生类, FinalAwaiter 需要它的类型。
+template<typename T, typename Promise>
+class LazyTaskPromiseBase : public TaskPromiseBase<T> {
+public:
+  LazyTaskPromiseBase() : TaskPromiseBase<T>(nullptr) {}
+
+  // 协程帧从 FrameAllocator 分配, 按 promise 类型统计
+  static void* operator new(std::size_t size) {
+    return FrameAllocator::allocate<Promise>(size);
+  }
+  static void operator delete(void* ptr, std::size_t size) {
+    FrameAllocator::deallocate(ptr, size);
+  }
+
+  std::suspend_always initial_suspend() {
+    return {};
+  }
+  FinalAwaiter<Promise> final_suspend() noexcept {
+    return {};
+  }
+
+  // 只由持有 LazyTask 的线程调用
+  bool is_started() const {
+    return m_is_started;
+  }
+  void start(AbstractExecutor* executor) {
+    m_is_started = true;
+    this->m_executor = executor;
+  }
+
+protected:
+  // 没有被 co_await 过时在当前线程上运行到第一个挂起点, 然后阻塞等待
+  void start_and_wait() {
+    if (!m_is_started) {
+      start(nullptr);
+      std::coroutine_handle<Promise>::from_promise(static_cast<Promise&>(*this)).resume();
+    }
+    this->wait_for_completed();
+  }
+
+private:
+  bool m_is_started = false;
+};
+
+template<typename T>
+class LazyTaskPromise : public LazyTaskPromiseBase<T, LazyTaskPromise<T>> {
+public:
+  LazyTask<T> get_return_object() {
+    return LazyTask<T>{std::coroutine_handle<LazyTaskPromise>::from_promise(*this)};
+  }
+
+  void return_value(T value) {
+    this->m_result = Result<T>(std::move(value));
+  }
+
+  T get_result() {
+    this->start_and_wait();
+    return this->m_result->get();
+  }
+};
+
+template<>
+class LazyTaskPromise<void> : public LazyTaskPromiseBase<void, LazyTaskPromise<void>> {
+public:
+  LazyTask<void> get_return_object();
+
+  void return_void() {
+    m_result = Result<void>();
+  }
+
+  void get_result() {
+    start_and_wait();
+    m_result->get();
+  }
+};
+
+// 惰性的 Task: co_await 时在等待者的线程上直接运行, 结束时直接回到等待者, 不经过 Executor 的队列。子协程在其中 co_await 的 awaiter 也使用等待者的 Executor.
+// 只能 co_await 一次; when_all/when_any/with_timeout/TaskGroup 需要已经开始运行的 Task.
+template<typename T>
+class LazyTask {
+public:
+  using promise_type = LazyTaskPromise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  explicit LazyTask(handle_type h) : m_co_handle(h) {}
+  LazyTask(const LazyTask&) = delete;
+  LazyTask(LazyTask&& task) : m_co_handle(std::exchange(task.m_co_handle, {})) {}
+  LazyTask& operator=(const LazyTask&) = delete;
+  LazyTask& operator=(LazyTask&&) = delete;
+  // 没有开始的协程直接销毁; 还在运行的协程结束时自己销毁。
+  ~LazyTask() {
+    if (!m_co_handle) {
+      return;
+    }
+    auto& promise = m_co_handle.promise();
+    if (!promise.is_started() || !promise.detach_continuation()) {
+      m_co_handle.destroy();
+    }
+  }
+
+  T get_result() {
+    return m_co_handle.promise().get_result();
+  }
+
+private:
+  friend class LazyTaskAwaiter<T>;
+  handle_type m_co_handle;
+};
+
+inline LazyTask<void> LazyTaskPromise<void>::get_return_object() {
+  return LazyTask<void>{std::coroutine_handle<LazyTaskPromise>::from_promise(*this)};
+}
+
+// 开始和结束都通过 ResumeTrampoline 切换, 不依赖编译器把 symmetric transfer 优化成尾调用:
+// 父协程由外层的循环恢复时把子协程交给这个循环, 否则在 await_suspend 中用一个新的循环运行子协程。
+// 子协程同步结束时 (没有挂起过) 新的循环切换回父协程之前停下, await_suspend 返回 false, 父协程不挂起;
+// 循环 co_await 大量同步结束的子协程, 或者一长串嵌套的子协程, 都不会增加调用栈。
+// 子协程挂起过时, 它在 final_suspend 中通过 ResumeTrampoline::transfer 恢复父协程, 和 Task 一样。
+template<typename T>
+class LazyTaskAwaiter : public Awaiter<T> {
+public:
+  LazyTaskAwaiter(LazyTask<T>&& t) : m_task(std::move(t)) {}
+  LazyTaskAwaiter(LazyTaskAwaiter&& ta) : Awaiter<T>(ta), m_task(std::move(ta.m_task)) {}
+
+  bool await_ready() {
+    return m_task.m_co_handle.promise().is_completed();
+  }
+  bool await_suspend(std::coroutine_handle<> handle) {
+    auto& promise = m_task.m_co_handle.promise();
+    if (promise.is_started()) {
+      return promise.set_continuation({handle, this->m_executor});
+    }
+    promise.start(this->m_executor);
+    promise.set_continuation({handle, this->m_executor});
+    if (ResumeTrampoline::try_defer(handle, m_task.m_co_handle)) {
+      return true;
+    }
+    // 在当前线程上运行子协程, 子协程同步结束时 resume 返回 true
+    return !ResumeTrampoline::resume(m_task.m_co_handle, handle);
+  }
+
+protected:
+  void resume_helper() override {
+    if constexpr (std::is_void_v<T>) {
+      m_task.get_result();
+      this->m_result = Result<void>();
+    } else {
+      this->m_result = Result<T>(m_task.get_result());
+    }
+  }
+
+private:
+  LazyTask<T> m_task;
+};
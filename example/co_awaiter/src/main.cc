@@ -1,11 +1,22 @@
 #include <iostream>
+#include <memory>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "task.h"
 #include "executor.h"
 #include "io_utils.h"
 #include "channel.h"
+#include "spsc_channel.h"
 #include "future_awaiter.h"
+#include "timeout_awaiter.h"
+#include "when_all.h"
+#include "when_any.h"
+#include "select.h"
+#include "task_group.h"
+#include "lazy_task.h"
+#include "benchmark.h"
 
 using namespace std;
 using namespace std::chrono_literals;
@@ -23,8 +34,13 @@ Task<int, NewThreadExecutor> sub_simple_task2() {
 }
 
 Task<int, LooperExecutor> simple_task() {
-  auto result1 = co_await sub_simple_task1().as_awaiter();
-  auto result2 = co_await sub_simple_task2();
+  // 两个子协程同时运行, 只需要等待 max(3s, 1s)
+  auto thread_id = std::this_thread::get_id();
+  auto [result1, result2] = co_await when_all(sub_simple_task1(), sub_simple_task2());
+  // 子协程在其他线程上结束, 父协程仍然在自己的 LooperExecutor 上恢复
+  if (std::this_thread::get_id() != thread_id) {
+    throw std::logic_error("when_all resumed the parent on a child's thread");
+  }
   auto result3 = co_await FutureAwaiter(std::async([]() {
       std::this_thread::sleep_for(1s);
       return 3;
@@ -98,12 +114,347 @@ void test_channel() {
   std::this_thread::sleep_for(2s);
   auto p = producer(channel);
 
-  std::this_thread::sleep_for(5s);
+  // 协程引用了 channel, 要等它们都结束
+  p.get_result();
+  c1.get_result();
+  c2.get_result();
   debug("test_channel end");
 }
 
-int main() {
+// 只有一个生产者和一个消费者时使用 SpscChannel, 不加锁
+Task<void, LooperExecutor> spsc_producer(SpscChannel<int>& channel) {
+  for (int i = 0; i < 5; i++) {
+    co_await (channel << i);
+    debug("spsc_producer send: ", i);
+  }
+}
+
+Task<void, NewThreadExecutor> spsc_consumer(SpscChannel<int>& channel) {
+  int v;
+  for (int i = 0; i < 5; i++) {
+    co_await (channel >> v);
+    debug("spsc_consumer received: ", v);
+    co_await 100ms;
+  }
+}
+
+void test_spsc_channel() {
+  SpscChannel<int> channel(2);
+  auto c = spsc_consumer(channel);
+  auto p = spsc_producer(channel);
+  p.get_result();
+  c.get_result();
+}
+
+// 批量读写: 一次加锁交接多个值
+Task<void, LooperExecutor> batch_producer(Channel<int>& channel) {
+  std::vector<int> values(4);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 4; j++) {
+      values[j] = i * 4 + j;
+    }
+    co_await channel.write_many(values);
+    debug("batch_producer send: ", values.front(), "..", values.back());
+  }
+}
+
+Task<void, NewThreadExecutor> batch_consumer(Channel<int>& channel) {
+  std::vector<int> values(8);
+  for (size_t total = 0; total < 12;) {
+    // 至少读 2 个, 最多 8 个
+    auto count = co_await channel.read_many(values, 2);
+    total += count;
+    debug("batch_consumer received ", count, " values, first: ", values.front());
+    co_await 100ms;
+  }
+}
+
+void test_channel_batch() {
+  auto channel = Channel<int>(3);
+  auto c = batch_consumer(channel);
+  auto p = batch_producer(channel);
+  p.get_result();
+  c.get_result();
+}
+
+// 只能移动的值: 写入的值一路移动到读者, 不会复制
+struct Buffer {
+  std::vector<char> bytes;
+};
+
+Task<void, LooperExecutor> buffer_producer(Channel<std::unique_ptr<Buffer>>& buffers, Channel<std::string>& names) {
+  for (int i = 1; i <= 3; i++) {
+    auto buffer = std::make_unique<Buffer>();
+    buffer->bytes.resize(i * 1024);
+    co_await buffers.write(std::move(buffer));
+    // 直接在等待写入的值上构造
+    co_await names.emplace(i, 'a');
+  }
+}
+
+Task<void, NewThreadExecutor> buffer_consumer(Channel<std::unique_ptr<Buffer>>& buffers, Channel<std::string>& names) {
+  for (int i = 0; i < 3; i++) {
+    auto buffer = co_await buffers.read();
+    auto name = co_await names.read();
+    debug("buffer_consumer received ", name, ": ", buffer->bytes.size(), " bytes");
+  }
+}
+
+void test_channel_move() {
+  Channel<std::unique_ptr<Buffer>> buffers(1);
+  Channel<std::string> names;
+  auto c = buffer_consumer(buffers, names);
+  auto p = buffer_producer(buffers, names);
+  p.get_result();
+  c.get_result();
+}
+
+// 同时等待两个 Channel, 最后一个参数是超时时间
+Task<void, LooperExecutor> select_consumer(Channel<int>& numbers, Channel<std::string>& words) {
+  for (int i = 0; i < 4; i++) {
+    try {
+      auto result = co_await select(numbers.read(), words.read(), 150ms);
+      if (result.index() == 0) {
+        debug("select_consumer received number: ", std::get<0>(result));
+      } else {
+        debug("select_consumer received word: ", std::get<1>(result));
+      }
+    } catch (const TimeoutException& e) {
+      debug("exception: ", e.what());
+    }
+  }
+}
+
+void test_select() {
+  Channel<int> numbers;
+  Channel<std::string> words;
+  auto c = select_consumer(numbers, words);
+  auto p = [](Channel<int>& numbers, Channel<std::string>& words) -> Task<void, NewThreadExecutor> {
+    int number = 1;
+    std::string word = "hello";
+    co_await (numbers << number);
+    co_await 100ms;
+    co_await (words << word);
+  }(numbers, words);
+  p.get_result();
+  c.get_result();
+}
+
+Task<void, LooperExecutor> timeout_consumer(Channel<int>& channel) {
+  // 前两次没有数据, 超时后 reader 从 channel 的等待列表中移除
+  for (int i = 0; i < 3; i++) {
+    try {
+      auto received = co_await with_timeout(channel.read(), 100ms);
+      debug("timeout_consumer received: ", received);
+    } catch (const TimeoutException& e) {
+      debug("exception: ", e.what());
+    }
+  }
+}
+
+void test_timeout() {
+  auto channel = Channel<int>();
+  auto c = timeout_consumer(channel);
+  std::this_thread::sleep_for(250ms);
+  int v = 1;
+  auto p = [](Channel<int>& channel, int& v) -> Task<void, LooperExecutor> {
+    co_await (channel << v);
+  }(channel, v);
+  c.get_result();
+  p.get_result();
+}
+
+Task<int, AsyncExecutor> replica(int id, std::chrono::milliseconds latency) {
+  co_await std::move(latency);
+  if (co_await cancellation_requested()) {
+    debug("replica ", id, " cancelled");
+  }
+  co_return id;
+}
+
+Task<int, LooperExecutor> hedged_request() {
+  // 同时向三个副本发出请求, 使用最快的结果, 其余的被取消
+  auto [index, id] = co_await when_any(replica(0, 300ms), replica(1, 100ms), replica(2, 200ms));
+  debug("fastest replica: ", id, " (index ", index, ")");
+  co_return id;
+}
+
+void test_when_any() {
+  hedged_request().get_result();
+  std::this_thread::sleep_for(300ms);
+}
+
+Task<int, AsyncExecutor> batch_item(int i, std::atomic<int>& running, std::atomic<int>& max_running) {
+  auto now = ++running;
+  for (auto seen = max_running.load(); now > seen && !max_running.compare_exchange_weak(seen, now);) {}
+  co_await 50ms;
+  running--;
+  co_return i;
+}
+
+Task<void, LooperExecutor> batch_job() {
+  // 20 个子协程, 最多同时运行 4 个
+  std::atomic<int> running = 0;
+  std::atomic<int> max_running = 0;
+  TaskGroup group(4);
+  for (int i = 0; i < 20; i++) {
+    co_await group.spawn([i, &running, &max_running]() {
+        return batch_item(i, running, max_running);
+      });
+  }
+  co_await group.join();
+  debug("batch done, max running: ", max_running.load());
+}
+
+void test_task_group() {
+  batch_job().get_result();
+}
+
+LazyTask<int> lazy_sub_task(int i) {
+  // 在父协程的线程上运行, co_await 之后也回到父协程的 Executor
+  debug("lazy_sub_task ", i, " started");
+  co_await 10ms;
+  if (i < 0) {
+    throw std::invalid_argument("negative");
+  }
+  co_return i * 2;
+}
+
+Task<int, LooperExecutor> lazy_parent() {
+  debug("lazy_parent started");
+  auto result = co_await lazy_sub_task(1) + co_await lazy_sub_task(2);
+  try {
+    co_await lazy_sub_task(-1);
+  } catch (const std::exception& e) {
+    debug("exception: ", e.what());
+  }
+  co_return result;
+}
+
+// 一长串嵌套的 LazyTask: 开始时逐层进入, 最内层挂起之后再逐层结束, 两个方向都不增加调用栈。
+// 每一层的父协程都在子协程的 final_suspend 返回之后才被恢复, 然后销毁子协程的帧。
+LazyTask<long> lazy_chain(int depth) {
+  if (depth == 0) {
+    co_await 1ms;
+    co_return 0;
+  }
+  co_return 1 + co_await lazy_chain(depth - 1);
+}
+
+Task<long, LooperExecutor> lazy_chain_parent() {
+  co_return co_await lazy_chain(1000000);
+}
+
+void test_lazy_task() {
+  auto result = lazy_parent().get_result();
+  // 没有被 co_await 过的 LazyTask 在 get_result 的线程上开始运行
+  result += lazy_sub_task(3).get_result();
+  debug("lazy result: ", result, ", lazy chain result: ", lazy_chain_parent().get_result());
+  auto never_started = lazy_sub_task(4);
+}
+
+Task<int, LooperExecutor> tiny_task(int i) {
+  co_return i;
+}
+
+void test_shared_executor() {
+  // 所有 Task<int, LooperExecutor> 共享同一个 LooperExecutor 线程。
+  FrameAllocator::set_stats_enabled(true);
+  long long sum = 0;
+  for (int round = 0; round < 2; round++) {
+    std::vector<Task<int, LooperExecutor>> tasks;
+    for (int i = 0; i < 100000; i++) {
+      tasks.push_back(tiny_task(i));
+    }
+    for (auto& task : tasks) {
+      sum += task.get_result();
+    }
+  }
+  debug("sum of 2 * 100000 tasks: ", sum);
+  FrameAllocator::dump_stats(std::cout);
+  FrameAllocator::set_stats_enabled(false);
+}
+
+// 每一层都 co_await 下一层: 子协程结束时恢复父协程不能增加调用栈, 否则没有尾调用优化时 (-O0) 会栈溢出。
+Task<long, LooperExecutor> deep_chain(int depth) {
+  if (depth == 0) {
+    co_return 0;
+  }
+  co_return 1 + co_await deep_chain(depth - 1);
+}
+
+void test_deep_chain() {
+  debug("deep chain result: ", deep_chain(1000000).get_result());
+}
+
+Task<int, AsyncExecutor> remote_value(int i) {
+  co_return i;
+}
+
+Task<void, NewThreadExecutor> unique_function_producer(Channel<int>& channel) {
+  for (int i = 0; i < 100; i++) {
+    co_await channel.write(i);
+  }
+}
+
+// 每一轮都经过真实的 awaiter 恢复协程: DispatchAwaiter (协程开始), SleepAwaiter (定时器), Channel 的读写,
+// 在其他 Executor 上结束的子协程, FutureAwaiter 的 Awaiter::resume 和 resume_exception.
+Task<int, LooperExecutor> unique_function_consumer(Channel<int>& channel) {
+  int sum = 0;
+  for (int i = 0; i < 100; i++) {
+    co_await 1ms;
+    sum += co_await channel.read();
+    sum += co_await remote_value(i);
+    sum += co_await FutureAwaiter(std::async(std::launch::async, [i]() {
+        return i;
+      }));
+    try {
+      co_await FutureAwaiter(std::async(std::launch::async, []() -> int {
+          throw std::runtime_error("test");
+        }));
+    } catch (const std::runtime_error&) {
+      sum++;
+    }
+  }
+  co_return sum;
+}
+
+void test_unique_function() {
+  // 恢复协程时提交给 Executor 的回调都不应该在堆上分配。先创建共享的 Executor, 不计入它们的启动。
+  shared_executor<LooperExecutor>();
+  shared_executor<AsyncExecutor>();
+  shared_executor<NewThreadExecutor>();
+  auto heap_allocations = unique_function_heap_allocations().load();
+  Channel<int> channel;
+  auto consumer = unique_function_consumer(channel);
+  auto producer = unique_function_producer(channel);
+  producer.get_result();
+  auto sum = consumer.get_result();
+  auto delta = unique_function_heap_allocations().load() - heap_allocations;
+  debug("UniqueFunction heap allocations: ", delta, ", sum: ", sum);
+  if (delta != 0) {
+    throw std::logic_error("UniqueFunction allocated on a resume path");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && std::string(argv[1]) == "bench") {
+    run_benchmarks();
+    return 0;
+  }
+
+  test_unique_function();
+  test_shared_executor();
   test_task();
+  test_timeout();
+  test_when_any();
+  test_task_group();
+  test_lazy_task();
+  test_deep_chain();
+  test_spsc_channel();
+  test_channel_batch();
+  test_select();
+  test_channel_move();
   test_channel();
 
   return 0;
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+// Vyukov 的有界无锁多生产者多消费者队列。
+// 每个槽有一个序号: 等于 pos 时可以写入, 等于 pos + 1 时可以读取, 读取后变为 pos + capacity 留给下一圈的写入。
+// 槽和读写位置都按缓存行对齐, 生产者和消费者不会在同一个缓存行上竞争。
+template<typename T>
+class MpmcRing {
+public:
+  static constexpr std::size_t kCacheLineSize = 64;
+
+  // capacity 向上取整到 2 的幂, 至少为 2: 只有一个槽时 "pos 已写入" 和 "pos + 1 可以写入" 的序号相同。
+  explicit MpmcRing(std::size_t capacity) {
+    std::size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    m_mask = size - 1;
+    m_slots = std::make_unique<Slot[]>(size);
+    for (std::size_t i = 0; i < size; i++) {
+      m_slots[i].m_sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  MpmcRing(const MpmcRing&) = delete;
+  MpmcRing& operator=(const MpmcRing&) = delete;
+  ~MpmcRing() {
+    clear();
+  }
+
+  bool try_push(T&& value) {
+    auto pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &m_slots[pos & m_mask];
+      auto sequence = slot->m_sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+      if (diff == 0) {
+        if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;   // 满了
+      } else {
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    new (slot->m_storage) T(std::move(value));
+    slot->m_sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T& value) {
+    return pop_with([&value](T& item) {
+        value = std::move(item);
+      });
+  }
+
+  // 只是一个估计值, 并发修改时可能已经过时
+  bool empty() const {
+    return m_dequeue_pos.load(std::memory_order_relaxed) >= m_enqueue_pos.load(std::memory_order_relaxed);
+  }
+
+  std::size_t capacity() const {
+    return m_mask + 1;
+  }
+
+  // 丢弃所有元素
+  void clear() {
+    while (pop_with([](T&) {})) {}
+  }
+
+private:
+  struct alignas(kCacheLineSize) Slot {
+    std::atomic<std::size_t> m_sequence;
+    alignas(T) unsigned char m_storage[sizeof(T)];
+  };
+
+  template<typename F>
+  bool pop_with(F&& func) {
+    auto pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &m_slots[pos & m_mask];
+      auto sequence = slot->m_sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(sequence - (pos + 1));
+      if (diff == 0) {
+        if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;   // 空了
+      } else {
+        pos = m_dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    auto item = std::launder(reinterpret_cast<T*>(slot->m_storage));
+    func(*item);
+    item->~T();
+    slot->m_sequence.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  std::unique_ptr<Slot[]> m_slots;
+  std::size_t m_mask;
+  alignas(kCacheLineSize) std::atomic<std::size_t> m_enqueue_pos{0};
+  alignas(kCacheLineSize) std::atomic<std::size_t> m_dequeue_pos{0};
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+// 分段的无锁多生产者单消费者队列: 值存放在固定大小的块 (Block) 中, 一个块写满之后再链接下一个块。
+// push 可以在任意线程调用, try_pop/wait 只能在唯一的消费者线程调用。
+// 生产者先在 m_push_index 上用 CAS 占住一个位置再写入, 不会访问没有占到位置的块, 所以消费者读完一个块后可以马上复用它:
+// 读完的块放回空闲链表 (最多 MaxFreeBlocks 个), 写满一个块时优先从中取。积压的任务不超过这些块的容量时不再分配内存。
+template<typename T, std::size_t BlockSize = 32, std::size_t MaxFreeBlocks = 16>
+class MpscQueue {
+public:
+  MpscQueue() : m_push_block(new Block), m_pop_block(m_push_block.load(std::memory_order_relaxed)) {}
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+  ~MpscQueue() {
+    T value;
+    while (try_pop(value)) {}
+    delete m_pop_block;
+    for (auto block = m_free_blocks.load(std::memory_order_relaxed); block;) {
+      delete std::exchange(block, block->m_next.load(std::memory_order_relaxed));
+    }
+  }
+
+  void push(T&& value) {
+    auto index = m_push_index.load();
+    Block* block;
+    while (true) {
+      if (index % kLap == BlockSize) {
+        std::this_thread::yield();    // 另一个生产者正在链接下一个块
+        index = m_push_index.load();
+        continue;
+      }
+      // 先读 index 再读块: index 没有变化时读到的就是它所在的块, 否则 CAS 失败
+      block = m_push_block.load(std::memory_order_acquire);
+      if (m_push_index.compare_exchange_weak(index, index + 1)) {
+        break;
+      }
+    }
+
+    auto offset = index % kLap;
+    if (offset + 1 == BlockSize) {
+      // 占到了块的最后一个位置, 由它链接下一个块, 之后的生产者跳过 offset == BlockSize 的位置
+      auto next = take_block();
+      m_push_block.store(next, std::memory_order_release);
+      m_push_index.store(index + 2, std::memory_order_release);
+      block->m_next.store(next, std::memory_order_release);
+    }
+    auto& slot = block->m_slots[offset];
+    slot.m_value = std::move(value);
+    slot.m_is_ready.store(true, std::memory_order_release);
+
+    // 先占住位置再读取 m_is_sleeping, 与 wait 中的顺序相反, 不会丢失唤醒。
+    if (m_is_sleeping.load()) {
+      m_is_sleeping.store(false);
+      m_is_sleeping.notify_one();
+    }
+  }
+
+  bool try_pop(T& value) {
+    auto& slot = m_pop_block->m_slots[m_pop_index % kLap];
+    if (!slot.m_is_ready.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = std::move(slot.m_value);
+    slot.m_is_ready.store(false, std::memory_order_relaxed);
+    if (++m_pop_index % kLap == BlockSize) {
+      // 读完了最后一个位置: 链接下一个块的生产者在写入它之前已经设置了 m_next
+      m_pop_index++;
+      auto block = std::exchange(m_pop_block, m_pop_block->m_next.load(std::memory_order_acquire));
+      recycle_block(block);
+    }
+    return true;
+  }
+
+  // 有生产者占住了位置但还没有写完时不为空, 但 try_pop 会失败。
+  bool empty() const {
+    return m_pop_index == m_push_index.load();
+  }
+
+  // 只有队列确实为空且 is_active 为 true 时才会阻塞, 由 push 或 notify 唤醒。
+  void wait(const std::atomic<bool>& is_active) {
+    m_is_sleeping.store(true);
+    if (!empty() || !is_active.load()) {
+      m_is_sleeping.store(false);
+      return;
+    }
+    m_is_sleeping.wait(true);
+  }
+
+  void notify() {
+    m_is_sleeping.store(false);
+    m_is_sleeping.notify_one();
+  }
+
+private:
+  // 每个块占 kLap 个 index, 最后一个 (offset == BlockSize) 表示正在链接下一个块
+  static constexpr std::size_t kLap = BlockSize + 1;
+
+  struct Slot {
+    T m_value;
+    std::atomic<bool> m_is_ready{false};
+  };
+
+  struct Block {
+    std::atomic<Block*> m_next{nullptr};
+    Slot m_slots[BlockSize];
+  };
+
+  // 空闲链表通过 m_next 链接。只有消费者放回, 同一时间只有一个生产者 (占到块的最后一个位置的) 取出,
+  // 取出的块不会在 CAS 之前被别人取走再放回, 没有 ABA 问题。
+  Block* take_block() {
+    auto block = m_free_blocks.load(std::memory_order_acquire);
+    while (block && !m_free_blocks.compare_exchange_weak(block, block->m_next.load(std::memory_order_relaxed),
+                                                         std::memory_order_acquire, std::memory_order_acquire)) {}
+    if (!block) {
+      return new Block;
+    }
+    m_free_count.fetch_sub(1, std::memory_order_relaxed);
+    block->m_next.store(nullptr, std::memory_order_relaxed);
+    return block;
+  }
+
+  void recycle_block(Block* block) {
+    if (m_free_count.load(std::memory_order_relaxed) >= MaxFreeBlocks) {
+      delete block;
+      return;
+    }
+    m_free_count.fetch_add(1, std::memory_order_relaxed);
+    auto head = m_free_blocks.load(std::memory_order_relaxed);
+    do {
+      block->m_next.store(head, std::memory_order_relaxed);
+    } while (!m_free_blocks.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  std::atomic<std::size_t> m_push_index{0};
+  std::atomic<Block*> m_push_block;
+  std::atomic<Block*> m_free_blocks{nullptr};
+  std::atomic<std::size_t> m_free_count{0};
+
+  // 只有消费者访问
+  std::size_t m_pop_index = 0;
+  Block* m_pop_block;
+
+  std::atomic<bool> m_is_sleeping{false};
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <exception>
+#include <utility>
 
 template<typename T>
 class Result {
@@ -8,13 +9,25 @@ public:
   explicit Result(T&& v) : m_value(std::move(v)) {}
   explicit Result(std::exception_ptr exc_ptr) : m_exc_ptr(exc_ptr) {}
 
-  T get() {
+  T get() const& {
     if (!m_exc_ptr) {
       return m_value;
     } else {
       std::rethrow_exception(m_exc_ptr);
     }
   }
+  // 只取一次结果时移动出去, T 可以是只能移动的类型
+  T get() && {
+    if (!m_exc_ptr) {
+      return std::move(m_value);
+    } else {
+      std::rethrow_exception(m_exc_ptr);
+    }
+  }
+
+  std::exception_ptr exception() const {
+    return m_exc_ptr;
+  }
 
 private:
   T m_value;
@@ -27,12 +40,16 @@ public:
   explicit Result() {}
   explicit Result(std::exception_ptr exc_ptr) : m_exc_ptr(exc_ptr) {}
 
-  void get() {
+  void get() const {
     if (m_exc_ptr) {
       std::rethrow_exception(m_exc_ptr);
     }
   }
 
+  std::exception_ptr exception() const {
+    return m_exc_ptr;
+  }
+
 private:
   std::exception_ptr m_exc_ptr;
 };
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// 可以平凡复制的 T 用 memcpy 整段复制, 否则逐个复制。
+template<typename T>
+void copy_values(const T* src, std::size_t count, T* dst) {
+  if constexpr (std::is_trivially_copyable_v<T>) {
+    if (count > 0) {
+      std::memcpy(dst, src, count * sizeof(T));
+    }
+  } else {
+    std::copy_n(src, count, dst);
+  }
+}
+
+template<typename T>
+void move_values(T* src, std::size_t count, T* dst) {
+  if constexpr (std::is_trivially_copyable_v<T>) {
+    if (count > 0) {
+      std::memcpy(dst, src, count * sizeof(T));
+    }
+  } else {
+    std::move(src, src + count, dst);
+  }
+}
+
+// 固定容量的环形缓冲区, 不会再分配内存。不是线程安全的, 由所有者加锁访问。
+// 批量读写最多分两段 (到数组末尾, 再从头开始) 复制。
+template<typename T>
+class RingBuffer {
+public:
+  explicit RingBuffer(std::size_t capacity) : m_values(capacity) {}
+
+  std::size_t size() const {
+    return m_size;
+  }
+  bool empty() const {
+    return m_size == 0;
+  }
+  bool full() const {
+    return m_size == m_values.size();
+  }
+
+  // fill(dst, n) 把接下来的 n 个值放到 dst, 最多调用两次。返回实际放入的数量
+  template<typename Fill>
+  std::size_t push_with(std::size_t count, Fill&& fill) {
+    count = std::min(count, m_values.size() - m_size);
+    if (count == 0) {
+      return 0;
+    }
+    auto tail = (m_head + m_size) % m_values.size();
+    auto first = std::min(count, m_values.size() - tail);
+    fill(m_values.data() + tail, first);
+    if (count > first) {
+      fill(m_values.data(), count - first);
+    }
+    m_size += count;
+    return count;
+  }
+
+  // 返回实际取出的数量
+  std::size_t pop_many(T* values, std::size_t count) {
+    count = std::min(count, m_size);
+    if (count == 0) {
+      return 0;
+    }
+    auto first = std::min(count, m_values.size() - m_head);
+    move_values(m_values.data() + m_head, first, values);
+    move_values(m_values.data(), count - first, values + first);
+    m_head = (m_head + count) % m_values.size();
+    m_size -= count;
+    return count;
+  }
+
+  void clear() {
+    for (auto& value : m_values) {
+      value = T{};
+    }
+    m_head = 0;
+    m_size = 0;
+  }
+
+private:
+  std::vector<T> m_values;
+  std::size_t m_head = 0;
+  std::size_t m_size = 0;
+};
@@ -1,118 +1,170 @@
 #pragma once
 
-#include <functional>
 #include <chrono>
-#include <queue>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <thread>
+#include <utility>
 
 #include "io_utils.h"
+#include "unique_function.h"
+#include "timer_queue.h"
+#include "timing_wheel.h"
 
-class DelayedExecutor {
-public:
-  explicit DelayedExecutor(std::function<void()>&& func, long long delay) : m_func(std::move(func)) {
-    using namespace std;
-    using namespace std::chrono;
-
-    auto now = system_clock::now();
-    auto current = duration_cast<milliseconds>(now.time_since_epoch()).count();
-    m_scheduled_time = current + delay;
-  }
-
-  void operator()() {
-    m_func();
-  }
-
-  long long delay() const {
-    using namespace std;
-    using namespace std::chrono;
-
-    auto now = system_clock::now();
-    auto current = duration_cast<milliseconds>(now.time_since_epoch()).count();
-    return current - m_scheduled_time;
-  }
+// Heap: 二叉堆, 适合定时器比较少的情况。
+// Wheel: 分层时间轮, 插入和删除都是 O(1), 适合有大量定时器的情况。
+enum class TimerBackend {
+  Heap,
+  Wheel,
+};
 
-  long long get_scheduled_time() const {
-    return m_scheduled_time;
+inline std::unique_ptr<AbstractTimerQueue> make_timer_queue(TimerBackend backend) {
+  if (backend == TimerBackend::Wheel) {
+    return std::make_unique<TimingWheel>();
   }
+  return std::make_unique<HeapTimerQueue>();
+}
 
-private:
-  std::function<void()> m_func;
-  long long m_scheduled_time;
+// Block: 在条件变量上等到 deadline, Linux 上一般会晚几十微秒。
+// Hybrid: 在条件变量上等到 deadline 前 kSpinTime, 剩下的时间自旋, 用一点 CPU 换更准的唤醒时间。
+//
+// bench_timer_jitter (`app bench`) 测量的 200 微秒定时器的唤醒延迟, 2000 个样本, -O2,
+// 1 个 vCPU 的 Xeon 虚拟机, Linux 6.18:
+//                  空闲                         另有 1 个占满 CPU 的进程
+//   Heap  Block    p50 ~62us   p99 ~120us       p50 ~56us   p99 ~60-100us
+//   Heap  Hybrid   p50 <1us    p99 ~1-4us       p50 ~3.8ms  p99 ~4.2ms
+//   Wheel Block    p50 ~100us  p99 ~170-200us   p50 ~100us  p99 ~150us
+//   Wheel Hybrid   p50 ~100us  p99 ~107-115us   p50 ~3.8ms  p99 ~4.2-4.4ms
+// 自旋时只是 yield, CPU 被其他线程占用时要等它的时间片用完, 所以核数少又有负载时 Hybrid 反而比 Block 差得多;
+// 完整的 `app bench` 中前面的测试留下的线程也会这样, 当时测得 Hybrid 的 p99 约 420us.
+// TimingWheel 把 deadline 向上取整到 tick, 还要再加上最多一个 tick (默认 100us)。
+enum class WaitMode {
+  Block,
+  Hybrid,
 };
 
-class DelayedExecutorCompare {
+class Scheduler : public AbstractTimerOwner {
 public:
-  bool operator()(const DelayedExecutor& a, const DelayedExecutor& b) {
-    return a.get_scheduled_time() > b.get_scheduled_time();
-  }
-};
+  static constexpr std::chrono::nanoseconds kSpinTime = std::chrono::microseconds(200);
 
-class Scheduler {
-public:
-  Scheduler() {
+  explicit Scheduler(TimerBackend backend = TimerBackend::Heap, WaitMode wait_mode = WaitMode::Block) : m_wait_mode(wait_mode) {
+    m_timer_queue = make_timer_queue(backend);
     m_is_active.store(true, std::memory_order_relaxed);
     m_work_thread = std::thread(&Scheduler::run_loop, this);
   }
 
   ~Scheduler() {
-    m_is_active.store(false, std::memory_order_relaxed);
     shutdown(false);
     join();
   }
 
   void run_loop() {
-    while (m_is_active.load(std::memory_order_relaxed) || !m_executor_queue.empty()) {
-      std::unique_lock lock(m_queue_mutex);
-      if (m_executor_queue.empty()) {
+    std::unique_lock lock(m_queue_mutex);
+    while (true) {
+      if (!m_is_active.load(std::memory_order_relaxed) && (m_does_discard_pending || m_timer_queue->empty())) {
+        break;
+      }
+      if (m_timer_queue->empty()) {
+        m_wakeup_time = std::numeric_limits<long long>::max();
         m_queue_cv.wait(lock);
-        if (m_executor_queue.empty()) {
-          continue;
-        }
+        continue;
       }
 
-      auto executor = m_executor_queue.top();
-      auto delay = executor.delay();
-      if (delay > 0) {
-        auto status = m_queue_cv.wait_for(lock, std::chrono::milliseconds(delay));
-        if (status != std::cv_status::timeout) {
-          // a new executable should be executed before.
-          debug("status != std::cv_status::timeout");
-          continue;
+      auto now = current_time();
+      auto deadline = m_timer_queue->next_deadline();
+      if (deadline > now) {
+        // 有更早的定时器加入时会被唤醒, 重新计算等待时间
+        m_wakeup_time = deadline;
+        auto remaining = std::chrono::nanoseconds(deadline - now);
+        if (m_wait_mode == WaitMode::Hybrid) {
+          if (remaining <= kSpinTime) {
+            // 自旋时不持有锁, 期间加入的更早的定时器最多晚 kSpinTime 触发
+            lock.unlock();
+            while (current_time() < deadline) {
+              std::this_thread::yield();
+            }
+            lock.lock();
+            continue;
+          }
+          remaining -= kSpinTime;
         }
+        m_queue_cv.wait_for(lock, remaining);
+        continue;
       }
-      m_executor_queue.pop();
-      lock.unlock();
 
-      executor();
+      // 执行回调期间加入的定时器不需要唤醒, 回调结束后会重新检查
+      m_wakeup_time = now;
+      auto expired = m_timer_queue->pop_expired(now);
+      lock.unlock();
+      run_timer_nodes(expired, now, m_lag_stats);
+      lock.lock();
     }
   }
 
-  void execute(std::function<void()>&& func, long long delay) {
-    delay = delay < 0 ? 0 : delay;
+  // delay 的单位是毫秒。
+  TimerHandle execute(UniqueFunction<void()>&& func, long long delay) {
+    return execute(std::move(func), std::chrono::milliseconds(delay));
+  }
 
-    if (m_is_active.load(std::memory_order_relaxed)) {
-      std::unique_lock lock(m_queue_mutex);
-      bool need_to_notify = m_executor_queue.empty() || delay < m_executor_queue.top().delay();
-      m_executor_queue.push(DelayedExecutor(std::move(func), delay));
-      lock.unlock();
-      if (need_to_notify) {
-        m_queue_cv.notify_one();
+  // 返回的句柄可以用来取消定时器; 不需要取消时直接丢弃即可。
+  TimerHandle execute(UniqueFunction<void()>&& func, std::chrono::nanoseconds delay) {
+    delay = delay.count() < 0 ? std::chrono::nanoseconds(0) : delay;
+
+    if (!m_is_active.load(std::memory_order_relaxed)) {
+      return {};
+    }
+    auto node = new TimerNode;
+    node->m_deadline = current_time() + delay.count();
+    node->m_func = std::move(func);
+    node->m_ref_count.store(2, std::memory_order_relaxed);   // Scheduler 和 TimerHandle 各一个
+
+    std::unique_lock lock(m_queue_mutex);
+    bool need_to_notify = node->m_deadline < m_wakeup_time;
+    m_timer_queue->push(node);
+    lock.unlock();
+    if (need_to_notify) {
+      m_queue_cv.notify_one();
+    }
+    return {this, node};
+  }
+
+  // 从队列中删除: HeapTimerQueue 是 O(log n), TimingWheel 是 O(1)。
+  // 已经触发或者已经取消的定时器返回 false.
+  bool cancel(TimerNode* node) override {
+    UniqueFunction<void()> func;
+    {
+      std::lock_guard lg(m_queue_mutex);
+      if (!node->m_is_queued) {
+        return false;
       }
+      m_timer_queue->remove(node);
+      func = std::move(node->m_func);
     }
+    // 在锁外面析构 callable 和释放节点
+    func = nullptr;
+    release_timer_node(node);
+    return true;
   }
 
+  // does_wait_for_complete 为 true 时等待已有的定时器到期执行完, 否则直接丢弃。
   void shutdown(bool does_wait_for_complete=true) {
+    std::lock_guard lg(m_queue_mutex);
     m_is_active.store(false, std::memory_order_relaxed);
-    if (does_wait_for_complete) {
-      std::lock_guard lg(m_queue_mutex);
-      decltype(m_executor_queue) empty_queue;
-      std::swap(m_executor_queue, empty_queue);
+    if (!does_wait_for_complete) {
+      m_does_discard_pending = true;
+      discard_timer_nodes(m_timer_queue->pop_all());
     }
     m_queue_cv.notify_all();
   }
 
+  // 已经触发的定时器的延迟
+  TimerLag timer_lag() const {
+    return m_lag_stats.get();
+  }
+
   void join() {
     if (m_work_thread.joinable()) {
       m_work_thread.join();
@@ -122,8 +174,114 @@ private:
   std::mutex m_queue_mutex;
   std::condition_variable m_queue_cv;
 
-  std::priority_queue<DelayedExecutor, std::vector<DelayedExecutor>, DelayedExecutorCompare> m_executor_queue;
-  
+  std::unique_ptr<AbstractTimerQueue> m_timer_queue;
+  WaitMode m_wait_mode;
+  bool m_does_discard_pending = false;
+  long long m_wakeup_time = std::numeric_limits<long long>::max();    // run_loop 下一次醒来的时间
+  TimerLagStats m_lag_stats;
+
   std::atomic<bool> m_is_active;
   std::thread m_work_thread;
 };
+
+// 没有自己的定时器的 Executor 共用的 Scheduler.
+inline Scheduler& shared_scheduler() {
+  static Scheduler scheduler(TimerBackend::Wheel);
+  return scheduler;
+}
+
+// Executor 工作线程自己的定时器, 没有单独的线程: 所属线程在空闲时等到 next_deadline, 然后调用 run_expired.
+// 任何线程都可以 add 和 cancel. 定时器一般在所属线程上触发, 所属线程在执行阻塞的任务时可以由其他线程通过 run_expired_for 代为触发。
+// 不同 TimerShard 之间的定时器没有先后顺序。
+// 默认使用 TimingWheel, 和 shared_scheduler() 一样: SleepAwaiter 和 with_timeout 会设置 (并取消) 大量定时器,
+// 插入和删除都是 O(1); 代价是定时器最多晚一个 tick (100 微秒) 触发。
+class TimerShard : public AbstractTimerOwner {
+public:
+  explicit TimerShard(TimerBackend backend = TimerBackend::Wheel) : m_timer_queue(make_timer_queue(backend)) {}
+  TimerShard(const TimerShard&) = delete;
+  TimerShard& operator=(const TimerShard&) = delete;
+  // 还没有触发的定时器直接丢弃
+  ~TimerShard() {
+    discard_timer_nodes(m_timer_queue->pop_all());
+  }
+
+  // 新的定时器比已有的都早时 is_earliest 为 true, 这时如果所属线程在等待, 需要唤醒它。
+  TimerHandle add(UniqueFunction<void()>&& func, std::chrono::nanoseconds delay, bool& is_earliest) {
+    auto node = new TimerNode;
+    node->m_deadline = current_time() + (delay.count() < 0 ? 0 : delay.count());
+    node->m_func = std::move(func);
+    node->m_ref_count.store(2, std::memory_order_relaxed);
+
+    std::lock_guard lg(m_mtx);
+    is_earliest = node->m_deadline < m_next_deadline.load(std::memory_order_relaxed);
+    m_timer_queue->push(node);
+    update_next_deadline();
+    return {this, node};
+  }
+
+  bool cancel(TimerNode* node) override {
+    UniqueFunction<void()> func;
+    {
+      std::lock_guard lg(m_mtx);
+      if (!node->m_is_queued) {
+        return false;
+      }
+      m_timer_queue->remove(node);
+      update_next_deadline();
+      func = std::move(node->m_func);
+    }
+    func = nullptr;
+    release_timer_node(node);
+    return true;
+  }
+
+  // 最早的 deadline, 没有定时器时是 max. 不加锁, 只用来决定等待多久。
+  long long next_deadline() const {
+    return m_next_deadline.load(std::memory_order_acquire);
+  }
+
+  // 在所属线程上执行所有到期的定时器, 返回是否有到期的定时器。没有到期的定时器时只读一次时钟, 不加锁。
+  bool run_expired() {
+    return run_expired_with(m_lag_stats);
+  }
+
+  // 在所属线程上执行 other 中到期的定时器, 延迟记录在这个 TimerShard 中 (TimerLagStats 只能由一个线程写入)。
+  bool run_expired_for(TimerShard& other) {
+    return other.run_expired_with(m_lag_stats);
+  }
+
+  TimerLag timer_lag() const {
+    return m_lag_stats.get();
+  }
+
+  static constexpr long long kNoDeadline = std::numeric_limits<long long>::max();
+
+private:
+  bool run_expired_with(TimerLagStats& stats) {
+    auto deadline = next_deadline();
+    if (deadline == kNoDeadline) {
+      return false;
+    }
+    auto now = current_time();
+    if (deadline > now) {
+      return false;
+    }
+    TimerNode* expired;
+    {
+      std::lock_guard lg(m_mtx);
+      expired = m_timer_queue->pop_expired(now);
+      update_next_deadline();
+    }
+    run_timer_nodes(expired, now, stats);
+    return expired != nullptr;
+  }
+
+  void update_next_deadline() {
+    m_next_deadline.store(m_timer_queue->empty() ? kNoDeadline : m_timer_queue->next_deadline(), std::memory_order_release);
+  }
+
+  std::mutex m_mtx;
+  std::unique_ptr<AbstractTimerQueue> m_timer_queue;
+  std::atomic<long long> m_next_deadline{kNoDeadline};
+  TimerLagStats m_lag_stats;
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <coroutine>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "executor.h"
+#include "channel.h"
+#include "timeout_awaiter.h"
+
+template<typename Op>
+struct SelectTraits;
+
+// 读操作的结果是读到的值, 写操作没有结果
+template<typename T>
+struct SelectTraits<ReaderAwaiter<T>> {
+  using channel_value_type = T;
+  using result_type = T;
+  static constexpr bool is_reader = true;
+};
+
+template<typename T>
+struct SelectTraits<WriterAwaiter<T>> {
+  using channel_value_type = T;
+  using result_type = std::monostate;
+  static constexpr bool is_reader = false;
+};
+
+// 同时等待多个 Channel 的读写, 只完成最先可以完成的一个: 返回的 variant 的 index() 是完成的操作的序号。
+// await_suspend 按地址顺序锁住所有 Channel, 有可以马上完成的操作时直接完成, 否则把所有操作登记到各自的等待列表中。
+// 之后由对方 Channel 通过 SelectClaim 抢占, 没有抢占到的操作不会被唤醒, 在 await_resume 中撤销登记。
+// 已经关闭的 Channel 上的操作视为可以马上完成, 它的 await_resume 抛出 ChannelException.
+template<typename... Ops>
+class SelectAwaiter {
+public:
+  using value_type = std::variant<typename SelectTraits<Ops>::result_type...>;
+
+  explicit SelectAwaiter(Ops&&... ops) : m_ops(std::move(ops)...) {}
+  SelectAwaiter(SelectAwaiter&& other) : m_ops(std::move(other.m_ops)), m_executor(other.m_executor) {}
+  // 协程在等待时被销毁: 抢占 select, 之后 Channel 不会再唤醒它。各个操作的析构函数撤销登记。
+  ~SelectAwaiter() {
+    m_claim.try_claim(kCancelled);
+  }
+
+  void install_executor(AbstractExecutor* executor) {
+    m_executor = executor;
+  }
+
+  bool await_ready() {
+    return false;
+  }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    m_claim.m_handle = handle;
+    m_claim.m_executor = m_executor;
+
+    std::tuple<CompletedWaiters<typename SelectTraits<Ops>::channel_value_type>...> completed;
+    {
+      auto mutexes = channel_mutexes();
+      std::array<std::unique_lock<std::mutex>, sizeof...(Ops)> locks;
+      for (std::size_t i = 0; i < mutexes.size(); i++) {
+        locks[i] = std::unique_lock(*mutexes[i]);
+      }
+      for_each_op([this, &completed](auto& op, auto index) {
+          if (m_claim.winner() != SelectClaim::kNone) {
+            return;
+          }
+          op.m_select = &m_claim;
+          op.m_select_index = index;
+          auto& op_completed = std::get<index>(completed);
+          if (!op.m_channel->is_active()) {
+            m_claim.try_claim(index);
+            op_completed.add(&op);
+          } else if constexpr (SelectTraits<std::decay_t<decltype(op)>>::is_reader) {
+            op.m_channel->push_reader_locked(&op, op_completed);
+          } else {
+            op.m_channel->push_writer_locked(&op, op_completed);
+          }
+        });
+    }
+    // 在锁外面唤醒, 包括马上完成的自己的操作
+    std::apply([](auto&... op_completed) {
+        (op_completed.wake(nullptr, nullptr), ...);
+      }, completed);
+    return !m_claim.arrive_last();
+  }
+
+  value_type await_resume() {
+    auto winner = m_claim.winner();
+    withdraw(winner);
+    return take_result(winner);
+  }
+
+  // 用于 with_timeout: 还没有操作完成时抢占 select 并撤销所有登记。
+  bool cancel() {
+    if (!m_claim.try_claim(kCancelled)) {
+      return false;
+    }
+    withdraw(kCancelled);
+    return true;
+  }
+
+private:
+  static constexpr std::size_t kCancelled = sizeof...(Ops);
+
+  template<typename F>
+  void for_each_op(F&& func) {
+    for_each_op(std::forward<F>(func), std::index_sequence_for<Ops...>{});
+  }
+  template<typename F, std::size_t... Is>
+  void for_each_op(F&& func, std::index_sequence<Is...>) {
+    (func(std::get<Is>(m_ops), std::integral_constant<std::size_t, Is>{}), ...);
+  }
+
+  // 按地址排序, 不同的 select 以相同的顺序加锁
+  std::array<std::mutex*, sizeof...(Ops)> channel_mutexes() {
+    std::array<std::mutex*, sizeof...(Ops)> mutexes;
+    for_each_op([&mutexes](auto& op, auto index) {
+        mutexes[index] = &op.m_channel->m_mtx;
+      });
+    std::sort(mutexes.begin(), mutexes.end(), std::less<>());
+    return mutexes;
+  }
+
+  // 没有完成的操作还可能在等待列表中
+  void withdraw(std::size_t winner) {
+    for_each_op([winner](auto& op, auto index) {
+        if (index != winner) {
+          op.cancel();
+        }
+      });
+  }
+
+  template<std::size_t I = 0>
+  value_type take_result(std::size_t winner) {
+    if constexpr (I == sizeof...(Ops)) {
+      throw std::logic_error("select resumed without a completed operation");
+    } else {
+      if (I != winner) {
+        return take_result<I + 1>(winner);
+      }
+      auto& op = std::get<I>(m_ops);
+      if constexpr (SelectTraits<std::decay_t<decltype(op)>>::is_reader) {
+        return value_type(std::in_place_index<I>, op.await_resume());
+      } else {
+        op.await_resume();
+        return value_type(std::in_place_index<I>);
+      }
+    }
+  }
+
+  std::tuple<Ops...> m_ops;
+  SelectClaim m_claim;
+  AbstractExecutor* m_executor = nullptr;
+};
+
+template<typename Arg>
+struct is_duration : std::false_type {};
+
+template<typename Rep, typename Period>
+struct is_duration<std::chrono::duration<Rep, Period>> : std::true_type {};
+
+template<typename... Ops, std::size_t... Is>
+void check_select_channels(const std::tuple<Ops&...>& ops, std::index_sequence<Is...>) {
+  std::array<const void*, sizeof...(Ops)> channels{std::get<Is>(ops).m_channel...};
+  std::sort(channels.begin(), channels.end(), std::less<>());
+  if (std::adjacent_find(channels.begin(), channels.end()) != channels.end()) {
+    throw std::invalid_argument("select needs a different channel for each operation");
+  }
+}
+
+template<typename... Ops, std::size_t... Is>
+SelectAwaiter<Ops...> make_select(std::tuple<Ops&...> ops, std::index_sequence<Is...> indexes) {
+  check_select_channels(ops, indexes);
+  return SelectAwaiter<Ops...>(std::move(std::get<Is>(ops))...);
+}
+
+// co_await select(ch1.read(), ch2.read(), ch3.write(v)), 每个操作需要在不同的 Channel 上。
+// 最后一个参数是时间时相当于 with_timeout(select(...), timeout), 超时时抛出 TimeoutException.
+template<typename... Args>
+auto select(Args&&... args) {
+  constexpr auto kCount = sizeof...(Args);
+  auto ops = std::forward_as_tuple(args...);
+  if constexpr (is_duration<std::decay_t<std::tuple_element_t<kCount - 1, std::tuple<Args...>>>>::value) {
+    auto timeout = std::get<kCount - 1>(ops);
+    auto awaiter = [&ops]<std::size_t... Is>(std::index_sequence<Is...> indexes) {
+        return make_select(std::tuple<std::decay_t<std::tuple_element_t<Is, std::tuple<Args...>>>&...>(std::get<Is>(ops)...), indexes);
+      }(std::make_index_sequence<kCount - 1>{});
+    return with_timeout(std::move(awaiter), timeout);
+  } else {
+    return make_select(std::tuple<std::decay_t<Args>&...>(args...), std::index_sequence_for<Args...>{});
+  }
+}
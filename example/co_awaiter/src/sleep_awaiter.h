@@ -1,6 +1,7 @@
 #pragma once
 
 #include <coroutine>
+#include <chrono>
 
 #include "executor.h"
 #include "scheduler.h"
@@ -8,18 +9,25 @@
 
 class SleepAwaiter : public Awaiter<void> {
 public:
-  explicit SleepAwaiter(long long duration) : m_duration(duration) {}
+  // duration 的单位是毫秒
+  explicit SleepAwaiter(long long duration) : m_duration(std::chrono::milliseconds(duration)) {}
   template<typename Rep, typename Period>
-  explicit SleepAwaiter(std::chrono::duration<Rep, Period>&& duration) : m_duration(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count()) {}
+  explicit SleepAwaiter(std::chrono::duration<Rep, Period>&& duration) : m_duration(std::chrono::duration_cast<std::chrono::nanoseconds>(duration)) {}
 
 protected:
+  // 由协程所在的 Executor 计时, 到期时已经在它的线程上, 直接恢复协程。
   void suspend_helper() override {
-    static auto scheduler = Scheduler();
-    scheduler.execute([this]() {
-        this->resume();
+    if (!m_executor) {
+      shared_scheduler().execute([this]() {
+          this->resume();
+        }, m_duration);
+      return;
+    }
+    m_executor->execute_after([this]() {
+        this->resume_inline();
       }, m_duration);
   }
 
 private:
-  long long m_duration;
+  std::chrono::nanoseconds m_duration;
 };
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <coroutine>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include "executor.h"
+#include "unique_function.h"
+
+template<typename T>
+class SpscChannel;
+
+// 只有一个生产者协程和一个消费者协程的 Channel, 用法与 Channel 相同: co_await (channel << v), co_await (channel >> v).
+// 缓冲区是单生产者单消费者的环形队列, 生产者只写 m_tail, 消费者只写 m_head, 各自缓存对方的位置,
+// 缓存的位置显示满 (或空) 时才重新读取。读写都不加锁, 不满 (或不空) 时不挂起。
+// 只有从空变为不空 (或从满变为不满) 时对方才可能在等待, 这时才唤醒它。
+template<typename T>
+class SpscChannel {
+public:
+  struct ChannelException : public std::exception {
+    const char* what() const noexcept {
+      return "Channel is closed.";
+    }
+  };
+
+  class ReaderAwaiter;
+  class WriterAwaiter;
+
+  // capacity 向上取整到 2 的幂
+  explicit SpscChannel(std::size_t capacity) {
+    std::size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    m_mask = size - 1;
+    m_slots = std::make_unique<Slot[]>(size);
+  }
+  SpscChannel(const SpscChannel&) = delete;
+  SpscChannel& operator=(const SpscChannel&) = delete;
+  ~SpscChannel() {
+    close();
+    std::optional<T> value;
+    while (try_pop(value)) {}
+  }
+
+  ReaderAwaiter read() {
+    check_closed();
+    return ReaderAwaiter(this);
+  }
+  WriterAwaiter write(T& value) {
+    check_closed();
+    return WriterAwaiter(this, value);
+  }
+  ReaderAwaiter operator>>(T& value) {
+    auto ra = read();
+    ra.m_value_ptr = &value;
+    return ra;
+  }
+  WriterAwaiter operator<<(T& value) {
+    return write(value);
+  }
+
+  void check_closed() {
+    if (!m_is_active.load(std::memory_order_relaxed)) {
+      throw ChannelException{};
+    }
+  }
+
+  bool is_active() {
+    return m_is_active.load(std::memory_order_relaxed);
+  }
+
+  // 唤醒正在等待的一方, 它们恢复后抛出 ChannelException.
+  void close() {
+    if (!m_is_active.exchange(false)) {
+      return;
+    }
+    if (auto reader = m_waiting_reader.exchange(nullptr)) {
+      reader->wake();
+    }
+    if (auto writer = m_waiting_writer.exchange(nullptr)) {
+      writer->wake();
+    }
+  }
+
+  class ReaderAwaiter {
+  public:
+    explicit ReaderAwaiter(SpscChannel* channel) : m_channel(channel) {}
+    ReaderAwaiter(ReaderAwaiter&& ra)
+      : m_channel(std::exchange(ra.m_channel, nullptr)),
+        m_value_ptr(std::exchange(ra.m_value_ptr, nullptr)),
+        m_executor(ra.m_executor) {}
+    ~ReaderAwaiter() {
+      cancel();
+    }
+
+    void install_executor(AbstractExecutor* executor) {
+      m_executor = executor;
+    }
+
+    bool await_ready() {
+      return m_channel->try_pop(m_value);
+    }
+    bool await_suspend(std::coroutine_handle<> handle) {
+      m_handle = handle;
+      return m_channel->wait_for_value(this);
+    }
+    T await_resume() {
+      m_channel->check_closed();
+      if (!m_value && !m_channel->try_pop(m_value)) {
+        throw ChannelException{};
+      }
+      m_channel = nullptr;
+      if (m_value_ptr) {
+        *m_value_ptr = *m_value;
+      }
+      return std::move(*m_value);
+    }
+
+    // 停止等待, 用于 with_timeout. 已经被唤醒时返回 false.
+    bool cancel() {
+      if (m_channel && m_channel->remove_reader(this)) {
+        m_channel = nullptr;
+        return true;
+      }
+      return false;
+    }
+
+  private:
+    friend class SpscChannel;
+
+    // 唤醒可能是过时的: 同一个协程的下一次 co_await 在同一个地址上登记了新的 awaiter.
+    // 所以在自己的 Executor 上重新检查, 还没有数据时重新登记, 不恢复协程。
+    void wake() {
+      SpscChannel::dispatch(m_executor, [this]() {
+          if (!m_channel->wait_for_value(this)) {
+            m_handle.resume();
+          }
+        });
+    }
+
+    SpscChannel* m_channel;
+    T* m_value_ptr = nullptr;
+    AbstractExecutor* m_executor = nullptr;
+    std::coroutine_handle<> m_handle = nullptr;
+    std::optional<T> m_value;
+  };
+
+  class WriterAwaiter {
+  public:
+    WriterAwaiter(SpscChannel* channel, T& value) : m_channel(channel), m_value(value) {}
+    WriterAwaiter(WriterAwaiter&& wa)
+      : m_channel(std::exchange(wa.m_channel, nullptr)),
+        m_value(std::move(wa.m_value)),
+        m_executor(wa.m_executor) {}
+    ~WriterAwaiter() {
+      cancel();
+    }
+
+    void install_executor(AbstractExecutor* executor) {
+      m_executor = executor;
+    }
+
+    bool await_ready() {
+      m_is_written = m_channel->try_push(m_value);
+      return m_is_written;
+    }
+    bool await_suspend(std::coroutine_handle<> handle) {
+      m_handle = handle;
+      return m_channel->wait_for_space(this);
+    }
+    void await_resume() {
+      m_channel->check_closed();
+      if (!m_is_written && !m_channel->try_push(m_value)) {
+        throw ChannelException{};
+      }
+      m_channel = nullptr;
+    }
+
+    bool cancel() {
+      if (m_channel && m_channel->remove_writer(this)) {
+        m_channel = nullptr;
+        return true;
+      }
+      return false;
+    }
+
+  private:
+    friend class SpscChannel;
+
+    void wake() {
+      SpscChannel::dispatch(m_executor, [this]() {
+          if (!m_channel->wait_for_space(this)) {
+            m_handle.resume();
+          }
+        });
+    }
+
+    SpscChannel* m_channel;
+    T m_value;
+    AbstractExecutor* m_executor = nullptr;
+    std::coroutine_handle<> m_handle = nullptr;
+    bool m_is_written = false;
+  };
+
+private:
+  static constexpr std::size_t kCacheLineSize = 64;
+
+  struct Slot {
+    alignas(T) unsigned char m_storage[sizeof(T)];
+  };
+
+  // 只在生产者协程中调用
+  bool try_push(T& value) {
+    auto tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_cached_head > m_mask) {
+      m_cached_head = m_head.load(std::memory_order_acquire);
+      if (tail - m_cached_head > m_mask) {
+        return false;
+      }
+    }
+    new (m_slots[tail & m_mask].m_storage) T(std::move(value));
+    // 先发布数据再检查等待的 reader, 与 wait_for_value 中的顺序相反, 都是 seq_cst, 不会丢失唤醒。
+    m_tail.store(tail + 1);
+    if (m_waiting_reader.load()) {
+      if (auto reader = m_waiting_reader.exchange(nullptr)) {
+        reader->wake();
+      }
+    }
+    return true;
+  }
+
+  // 只在消费者协程中调用
+  bool try_pop(std::optional<T>& value) {
+    auto head = m_head.load(std::memory_order_relaxed);
+    if (head == m_cached_tail) {
+      m_cached_tail = m_tail.load(std::memory_order_acquire);
+      if (head == m_cached_tail) {
+        return false;
+      }
+    }
+    auto item = std::launder(reinterpret_cast<T*>(m_slots[head & m_mask].m_storage));
+    value = std::move(*item);
+    item->~T();
+    m_head.store(head + 1);
+    if (m_waiting_writer.load()) {
+      if (auto writer = m_waiting_writer.exchange(nullptr)) {
+        writer->wake();
+      }
+    }
+    return true;
+  }
+
+  // 登记后再检查一次, 期间已经有数据或者已经关闭时撤销登记, 不挂起。撤销失败说明对方已经在唤醒它了。
+  bool wait_for_value(ReaderAwaiter* reader) {
+    m_waiting_reader.store(reader);
+    if (m_tail.load() != m_head.load(std::memory_order_relaxed) || !m_is_active.load()) {
+      return !remove_reader(reader);
+    }
+    return true;
+  }
+  bool wait_for_space(WriterAwaiter* writer) {
+    m_waiting_writer.store(writer);
+    if (m_tail.load(std::memory_order_relaxed) - m_head.load() <= m_mask || !m_is_active.load()) {
+      return !remove_writer(writer);
+    }
+    return true;
+  }
+
+  bool remove_reader(ReaderAwaiter* reader) {
+    return m_waiting_reader.compare_exchange_strong(reader, nullptr);
+  }
+  bool remove_writer(WriterAwaiter* writer) {
+    return m_waiting_writer.compare_exchange_strong(writer, nullptr);
+  }
+
+  static void dispatch(AbstractExecutor* executor, UniqueFunction<void()>&& func) {
+    if (executor) {
+      executor->execute(std::move(func));
+    } else {
+      func();
+    }
+  }
+
+  std::unique_ptr<Slot[]> m_slots;
+  std::size_t m_mask;
+
+  // 生产者
+  alignas(kCacheLineSize) std::atomic<std::size_t> m_tail{0};
+  std::size_t m_cached_head = 0;
+  // 消费者
+  alignas(kCacheLineSize) std::atomic<std::size_t> m_head{0};
+  std::size_t m_cached_tail = 0;
+  // 很少修改, 两边都只是读取
+  alignas(kCacheLineSize) std::atomic<ReaderAwaiter*> m_waiting_reader{nullptr};
+  std::atomic<WriterAwaiter*> m_waiting_writer{nullptr};
+  std::atomic<bool> m_is_active{true};
+};
@@ -2,10 +2,22 @@
 
 #include <coroutine>
 #include <utility>
+#include <functional>
 
 #include "task_promise.h"
 #include "task_awaiter.h"
 
+template<typename... Tasks>
+class WhenAllAwaiter;
+
+template<typename T, typename Executor>
+class WhenAllVectorAwaiter;
+
+template<typename T, typename Tasks>
+class WhenAnyAwaiter;
+
+class TaskGroup;
+
 template<typename T, typename Executor>
 class Task {
 public:
@@ -16,8 +28,9 @@ public:
   Task(const Task&) = delete;
   Task(Task&& task) : m_co_handle(std::exchange(task.m_co_handle, {})) {}
   Task& operator=(const Task&) = delete;
+  // 协程还在运行时不能销毁协程帧, 改为让它结束时自己销毁。
   ~Task() {
-    if (m_co_handle) {
+    if (m_co_handle && !m_co_handle.promise().detach_continuation()) {
       m_co_handle.destroy();
     }
   }
@@ -26,8 +39,13 @@ public:
     return m_co_handle.promise().get_result();
   }
 
+  // 请求协程尽早结束, 见 cancellation_requested()
+  void request_cancel() {
+    m_co_handle.promise().request_cancel();
+  }
+
   Task& then(std::function<void(T)>&& func) {
-    m_co_handle.promise().on_completed([func](auto result) {
+    m_co_handle.promise().on_completed([func](const auto& result) {
         try {
           func(result.get());
         } catch (std::exception& e) {
@@ -38,7 +56,7 @@ public:
   }
 
   Task& catching(std::function<void(const std::exception&)>&& func) {
-    m_co_handle.promise().on_completed([func](auto result) {
+    m_co_handle.promise().on_completed([func](const auto& result) {
         try {
           result.get();
         } catch (const std::exception& e) {
@@ -49,7 +67,7 @@ public:
   }
 
   Task& finally(std::function<void()>&& func) {
-    m_co_handle.promise().on_completed([func](auto) {
+    m_co_handle.promise().on_completed([func](const auto&) {
         func();
       });
     return *this;
@@ -60,6 +78,13 @@ public:
   }
 
 private:
+  friend class TaskAwaiter<T, Executor>;
+  template<typename... Tasks>
+  friend class WhenAllAwaiter;
+  friend class WhenAllVectorAwaiter<T, Executor>;
+  template<typename T1, typename Tasks>
+  friend class WhenAnyAwaiter;
+  friend class TaskGroup;
   handle_type m_co_handle;
 };
 
@@ -74,7 +99,7 @@ public:
   Task(Task&& task) : m_co_handle(std::exchange(task.m_co_handle, {})) {}
   Task& operator=(const Task&) = delete;
   ~Task() {
-    if (m_co_handle) {
+    if (m_co_handle && !m_co_handle.promise().detach_continuation()) {
       m_co_handle.destroy();
     }
   }
@@ -83,10 +108,15 @@ public:
     m_co_handle.promise().get_result();
   }
 
+  void request_cancel() {
+    m_co_handle.promise().request_cancel();
+  }
+
   Task& then(std::function<void()>&& func) {
-    m_co_handle.promise().on_completed([func](auto result) {
+    m_co_handle.promise().on_completed([func](const auto& result) {
         try {
-          func(result.get());
+          result.get();
+          func();
         } catch (std::exception& e) {
           // ignore
         }
@@ -95,7 +125,7 @@ public:
   }
 
   Task& catching(std::function<void(const std::exception&)>&& func) {
-    m_co_handle.promise().on_completed([func](auto result) {
+    m_co_handle.promise().on_completed([func](const auto& result) {
         try {
           result.get();
         } catch (const std::exception& e) {
@@ -106,7 +136,7 @@ public:
   }
 
   Task& finally(std::function<void()>&& func) {
-    m_co_handle.promise().on_completed([func](auto result) {
+    m_co_handle.promise().on_completed([func](const auto& result) {
         func();
       });
     return *this;
@@ -117,5 +147,12 @@ public:
   }
 
 private:
+  friend class TaskAwaiter<void, Executor>;
+  template<typename... Tasks>
+  friend class WhenAllAwaiter;
+  friend class WhenAllVectorAwaiter<void, Executor>;
+  template<typename T1, typename Tasks>
+  friend class WhenAnyAwaiter;
+  friend class TaskGroup;
   handle_type m_co_handle;
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <coroutine>
+#include <type_traits>
 
 #include "task.h"
 #include "executor.h"
@@ -15,14 +16,32 @@ public:
   TaskAwaiter(Task<T, Executor>&& t) : m_task(std::move(t)) {}
   TaskAwaiter(TaskAwaiter&& ta) : Awaiter<T>(ta), m_task(std::move(ta.m_task)) {}
 
-protected:
-  void suspend_helper() override {
-    m_task.finally([this]() {
-        this->resume_unsafe();
-      });
+  bool await_ready() {
+    return m_task.m_co_handle.promise().is_completed();
+  }
+  // 子协程结束时在 final_suspend 中直接恢复 (ResumeTrampoline), 而不是在它的回调里恢复。
+  // 子协程已经结束时返回 false, 不挂起。
+  bool await_suspend(std::coroutine_handle<> handle) {
+    return m_task.m_co_handle.promise().set_continuation({handle, this->m_executor});
+  }
+
+  // 不再等待子协程: 子协程继续运行, 结束时自己销毁。子协程已经结束时返回 false.
+  bool cancel() {
+    if (!m_task.m_co_handle.promise().detach_continuation()) {
+      return false;
+    }
+    m_task.m_co_handle = nullptr;
+    return true;
   }
+
+protected:
   void resume_helper() override {
-    this->m_result = Result<T>(m_task.get_result());
+    if constexpr (std::is_void_v<T>) {
+      m_task.get_result();
+      this->m_result = Result<void>();
+    } else {
+      this->m_result = Result<T>(m_task.get_result());
+    }
   }
   
 private:
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <coroutine>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "executor.h"
+#include "task.h"
+
+// 限制同时运行的子协程数量, 并且可以一次等待所有子协程结束:
+//   TaskGroup group(8);
+//   for (auto& item : items) {
+//     co_await group.spawn([&item]() { return process(item); });
+//   }
+//   co_await group.join();
+//
+// Task 创建时就开始运行了, 所以 spawn 接受一个返回 Task 的函数, 有空位时才调用它。
+// 已经有 max_in_flight 个子协程在运行时, spawn 挂起调用者, 直到有子协程结束 (背压)。
+// 子协程不被 TaskGroup 持有, 结束时自己销毁协程帧; join 抛出第一个结束的子协程的异常。
+class TaskGroup {
+public:
+  explicit TaskGroup(std::size_t max_in_flight = std::numeric_limits<std::size_t>::max()) : m_max_in_flight(max_in_flight) {
+    if (max_in_flight == 0) {
+      throw std::invalid_argument("max_in_flight must be greater than 0");
+    }
+  }
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+  // 子协程会访问 TaskGroup, 所以在析构时等待它们结束。应该在析构之前 co_await join().
+  ~TaskGroup() {
+    std::unique_lock lock(m_mtx);
+    m_idle_cv.wait(lock, [this]() { return m_in_flight == 0; });
+  }
+
+  template<typename Factory>
+  class SpawnAwaiter {
+  public:
+    SpawnAwaiter(TaskGroup* group, Factory&& factory) : m_group(group), m_factory(std::move(factory)) {}
+
+    void install_executor(AbstractExecutor* executor) {
+      m_executor = executor;
+    }
+
+    bool await_ready() {
+      std::lock_guard lg(m_group->m_mtx);
+      return m_group->try_acquire();
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::lock_guard lg(m_group->m_mtx);
+      if (m_group->try_acquire()) {
+        return false;
+      }
+      m_group->m_spawners.push_back({handle, m_executor});
+      return true;
+    }
+
+    // 恢复时已经占有一个空位, 由子协程结束时释放。
+    void await_resume() {
+      try {
+        m_group->adopt(m_factory());
+      } catch (...) {
+        m_group->release(nullptr);
+        throw;
+      }
+    }
+
+  private:
+    TaskGroup* m_group;
+    Factory m_factory;
+    AbstractExecutor* m_executor = nullptr;
+  };
+
+  class JoinAwaiter {
+  public:
+    explicit JoinAwaiter(TaskGroup* group) : m_group(group) {}
+
+    void install_executor(AbstractExecutor* executor) {
+      m_executor = executor;
+    }
+
+    bool await_ready() {
+      std::lock_guard lg(m_group->m_mtx);
+      return m_group->m_in_flight == 0;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      std::lock_guard lg(m_group->m_mtx);
+      if (m_group->m_in_flight == 0) {
+        return false;
+      }
+      m_group->m_joiner = {handle, m_executor};
+      return true;
+    }
+
+    // 抛出异常后清除, TaskGroup 可以继续使用。
+    void await_resume() {
+      std::exception_ptr exception;
+      {
+        std::lock_guard lg(m_group->m_mtx);
+        exception = std::exchange(m_group->m_exception, nullptr);
+      }
+      if (exception) {
+        std::rethrow_exception(exception);
+      }
+    }
+
+  private:
+    TaskGroup* m_group;
+    AbstractExecutor* m_executor = nullptr;
+  };
+
+  // co_await group.spawn(factory), factory 返回 Task<T, Executor>.
+  template<typename Factory>
+  SpawnAwaiter<std::decay_t<Factory>> spawn(Factory&& factory) {
+    return {this, std::forward<Factory>(factory)};
+  }
+
+  // 只能有一个协程在等待 join.
+  JoinAwaiter join() {
+    return JoinAwaiter(this);
+  }
+
+  std::size_t in_flight() {
+    std::lock_guard lg(m_mtx);
+    return m_in_flight;
+  }
+
+private:
+  struct Waiter {
+    std::coroutine_handle<> m_handle = nullptr;
+    AbstractExecutor* m_executor = nullptr;
+  };
+
+  bool try_acquire() {
+    if (m_in_flight < m_max_in_flight) {
+      m_in_flight++;
+      return true;
+    }
+    return false;
+  }
+
+  // 丢弃 Task 时它会 detach, 子协程结束时自己销毁协程帧。
+  template<typename T, typename Executor>
+  void adopt(Task<T, Executor>&& task) {
+    task.m_co_handle.promise().on_completed([this](const Result<T>& result) {
+        release(result.exception());
+      });
+  }
+
+  // 子协程结束: 空位直接交给下一个等待的 spawn, 没有的话空位数减一, 减到 0 时恢复 join.
+  void release(std::exception_ptr exception) {
+    Waiter waiter;
+    std::unique_lock lock(m_mtx);
+    if (exception && !m_exception) {
+      m_exception = exception;
+    }
+    if (!m_spawners.empty()) {
+      waiter = m_spawners.front();
+      m_spawners.pop_front();
+    } else if (--m_in_flight == 0) {
+      waiter = std::exchange(m_joiner, {});
+      m_idle_cv.notify_all();
+    }
+    lock.unlock();
+    dispatch(waiter);
+  }
+
+  static void dispatch(const Waiter& waiter) {
+    if (!waiter.m_handle) {
+      return;
+    }
+    auto handle = waiter.m_handle;
+    if (waiter.m_executor) {
+      waiter.m_executor->execute([handle]() {
+          handle.resume();
+        });
+    } else {
+      handle.resume();
+    }
+  }
+
+  std::mutex m_mtx;
+  std::condition_variable m_idle_cv;
+  std::size_t m_max_in_flight;
+  std::size_t m_in_flight = 0;
+  std::deque<Waiter> m_spawners;
+  Waiter m_joiner;
+  std::exception_ptr m_exception;
+};
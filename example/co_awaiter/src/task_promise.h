@@ -2,9 +2,12 @@
 
 #include <coroutine>
 #include <optional>
-#include <functional>
-#include <list>
 #include <chrono>
+#include <type_traits>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include "task.h"
 #include "result.h"
@@ -12,40 +15,154 @@
 #include "dispatch_awaiter.h"
 #include "sleep_awaiter.h"
 #include "channel_awaiter.h"
+#include "unique_function.h"
+#include "frame_allocator.h"
 
 template<typename T, typename Executor>
 class Task;
 
-template<typename T, typename Executor>
-class TaskPromise {
+template<typename T>
+class LazyTask;
+
+template<typename T>
+class LazyTaskAwaiter;
+
+// 在当前线程上恢复协程, 协程结束时要切换到的 continuation 也由这里的循环恢复, 而不是嵌套调用。
+// await_suspend 返回 coroutine_handle 的 symmetric transfer 只有被编译器优化成尾调用时 (GCC 需要 -O2) 才不增加调用栈,
+// 不优化时 (例如 -O0) 一长串 co_await 的子协程依次结束会一层层嵌套恢复, 最终栈溢出。
+class ResumeTrampoline {
 public:
-  Task<T, Executor> get_return_object() {
-    return Task{std::coroutine_handle<TaskPromise>::from_promise(*this)};
+  // 恢复 handle 以及之后的 continuation, 直到没有 continuation 为止。
+  // 要切换到 stop 时不恢复它, 返回 true.
+  static bool resume(std::coroutine_handle<> handle, std::coroutine_handle<> stop = nullptr) {
+    ResumeTrampoline trampoline;
+    auto outer = std::exchange(t_current, &trampoline);
+    bool is_stopped = false;
+    while (handle) {
+      if (handle == stop) {
+        is_stopped = true;
+        break;
+      }
+      trampoline.m_resuming = handle;
+      trampoline.m_next = nullptr;
+      handle.resume();
+      handle = trampoline.m_next;
+    }
+    t_current = outer;
+    return is_stopped;
   }
-  DispatchAwaiter initial_suspend() {
-    return DispatchAwaiter{&m_executor};
+
+  // 在协程 handle 挂起时 (await_suspend 中) 调用: handle 是由当前线程上最内层的循环直接恢复的时候,
+  // 把 next 交给这个循环, 返回 true, 在 handle 的这次 resume 返回后由它恢复。
+  static bool try_defer(std::coroutine_handle<> handle, std::coroutine_handle<> next) {
+    if (t_current && t_current->m_resuming == handle && !t_current->m_next) {
+      t_current->m_next = next;
+      return true;
+    }
+    return false;
   }
-  std::suspend_always final_suspend() noexcept {
-    return {};
+
+  // 在协程 handle 的 final_suspend 中调用, 之后要恢复 next. 不能交给外层的循环时开始一个新的循环。
+  // next 可能马上销毁 handle 的协程帧, 调用者之后不能再访问它。
+  static void transfer(std::coroutine_handle<> handle, std::coroutine_handle<> next) {
+    if (!try_defer(handle, next)) {
+      resume(next);
+    }
   }
-  void unhandled_exception() {
-    std::lock_guard lg(m_mtx);
-    m_result = Result<T>(std::current_exception());
 
-    m_cv.notify_all();
-    notify_callbacks();
+private:
+  static inline thread_local ResumeTrampoline* t_current = nullptr;
+
+  std::coroutine_handle<> m_resuming = nullptr;
+  std::coroutine_handle<> m_next = nullptr;
+};
+
+// 协程结束时先挂起, 再通知等待者。这样等待者被恢复后可以安全地销毁协程帧。
+// 等待者可能在 ResumeTrampoline::transfer 中就销毁了协程帧 (这时 await_suspend 还在栈上), 之后只能使用局部变量。
+template<typename Promise>
+struct FinalAwaiter {
+  bool await_ready() noexcept {
+    return false;
+  }
+  void await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+    bool is_detached = false;
+    auto next = handle.promise().complete(is_detached);
+    if (is_detached) {
+      handle.destroy();   // 没有 Task 持有这个协程了, 自己销毁
+    } else if (next) {
+      ResumeTrampoline::transfer(handle, next);
+    }
   }
+  void await_resume() noexcept {}
+};
 
-  void return_value(T value) {
-    std::lock_guard lg(m_mtx);
-    m_result = Result<T>(std::move(value));
-    m_cv.notify_all();
-    notify_callbacks();
+template<typename Executor>
+AbstractExecutor* find_executor() {
+  return &shared_executor<Executor>();
+}
+
+template<typename Executor, typename Arg, typename... Args>
+AbstractExecutor* find_executor(Arg& arg, Args&... args) {
+  if constexpr (std::is_base_of_v<Executor, Arg>) {
+    return &arg;
+  } else {
+    return find_executor<Executor>(args...);
+  }
+}
+
+// co_await cancellation_requested() 返回当前协程是否被请求取消 (例如 when_any 中落后的协程), 不会挂起。
+struct CancellationRequested {};
+
+inline CancellationRequested cancellation_requested() {
+  return {};
+}
+
+struct CancellationAwaiter {
+  bool await_ready() {
+    return true;
+  }
+  void await_suspend(std::coroutine_handle<>) {}
+  bool await_resume() {
+    return m_is_cancel_requested;
+  }
+
+  bool m_is_cancel_requested;
+};
+
+// 协程结束后要恢复的等待者: 一个协程 (TaskAwaiter), 或者一个回调 (例如 get_result 的同步等待)。
+struct Continuation {
+  std::coroutine_handle<> m_handle = nullptr;
+  AbstractExecutor* m_executor = nullptr;
+  void (*m_callback)(void* context) = nullptr;
+  void* m_context = nullptr;
+};
+
+// 完成状态由一个原子变量表示, 不需要加锁:
+//   0                 -> 运行中
+//   kHasContinuation  -> 运行中, 已经设置了 continuation
+//   kCompleted        -> 已结束
+//   kDetached         -> 运行中, 等待者已经放弃 (例如 with_timeout 超时), 结束时协程自己销毁
+// 唯一的 continuation 直接存放在 promise 中, then/catching/finally 的回调放在一个无锁链表中。
+template<typename T>
+class TaskPromiseBase {
+public:
+  explicit TaskPromiseBase(AbstractExecutor* executor) : m_executor(executor) {}
+  TaskPromiseBase(const TaskPromiseBase&) = delete;
+  TaskPromiseBase& operator=(const TaskPromiseBase&) = delete;
+  ~TaskPromiseBase() {
+    auto node = m_callbacks.load(std::memory_order_acquire);
+    while (node && node != closed_callbacks()) {
+      delete std::exchange(node, node->m_next);
+    }
+  }
+
+  void unhandled_exception() {
+    m_result = Result<T>(std::current_exception());
   }
 
   template<typename AwaiterImpl>
   AwaiterImpl await_transform(AwaiterImpl&& awaiter) {
-    awaiter.install_executor(&m_executor);
+    awaiter.install_executor(m_executor);
     return awaiter;
   }
 
@@ -54,127 +171,235 @@ public:
     return await_transform(TaskAwaiter<T1, Executor1>{std::move(task)});
   }
 
+  // 需要包含 lazy_task.h
+  template<typename T1>
+  LazyTaskAwaiter<T1> await_transform(LazyTask<T1>&& task) {
+    return await_transform(LazyTaskAwaiter<T1>{std::move(task)});
+  }
+
   template<typename Rep, typename Period>
   SleepAwaiter await_transform(std::chrono::duration<Rep, Period>&& duration) {
     return await_transform(SleepAwaiter(std::move(duration)));
   }
 
-  T get_result() {
-    std::unique_lock lock(m_mtx);
-    if (!m_result.has_value()) {
-      m_cv.wait(lock);
+  CancellationAwaiter await_transform(CancellationRequested) {
+    return {is_cancel_requested()};
+  }
+
+  void on_completed(UniqueFunction<void(const Result<T>&)>&& func) {
+    auto node = new CallbackNode{std::move(func), nullptr};
+    auto head = m_callbacks.load(std::memory_order_acquire);
+    do {
+      if (head == closed_callbacks()) {
+        // 已经结束了, 直接调用
+        func = std::move(node->m_func);
+        delete node;
+        func(*m_result);
+        return;
+      }
+      node->m_next = head;
+    } while (!m_callbacks.compare_exchange_weak(head, node, std::memory_order_acq_rel, std::memory_order_acquire));
+  }
+
+  bool is_completed() const {
+    return m_state.load(std::memory_order_acquire) & kCompleted;
+  }
+
+  // 协程结束后恢复 continuation. 已经结束时返回 false, 由调用者自己恢复。
+  // 同一时间只能有一个 continuation.
+  bool set_continuation(const Continuation& continuation) {
+    m_continuation = continuation;
+    unsigned int expected = 0;
+    return m_state.compare_exchange_strong(expected, kHasContinuation, std::memory_order_release, std::memory_order_acquire);
+  }
+
+  // 撤销 set_continuation 设置的 continuation, 并且不再持有协程, 协程结束时自己销毁。
+  // 协程已经结束 (continuation 即将或已经被恢复) 时返回 false.
+  // 还没有设置 continuation 时也可以调用。
+  bool detach_continuation() {
+    auto state = m_state.load(std::memory_order_acquire);
+    while (!(state & kCompleted)) {
+      if (m_state.compare_exchange_weak(state, kDetached, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return true;
+      }
     }
-    return m_result->get();
+    return false;
   }
 
-  void on_completed(std::function<void(Result<T>)>&& func) {
-    std::unique_lock lock(m_mtx);
-    if (m_result.has_value()) {
-      auto value = m_result.value();
-      lock.unlock();
-      func(value);
-    } else {
-      m_completion_callbacks.push_back(std::move(func));
+  // 请求协程尽早结束, 协程中通过 co_await cancellation_requested() 检查。只是一个标记, 不会打断正在等待的 awaiter.
+  void request_cancel() {
+    m_is_cancel_requested.store(true, std::memory_order_relaxed);
+  }
+  bool is_cancel_requested() const {
+    return m_is_cancel_requested.load(std::memory_order_relaxed);
+  }
+
+  // 在 final_suspend 中调用, 返回接下来要在当前线程上恢复的协程, 没有时返回空的 handle.
+  // is_detached 为 true 时由调用者销毁协程帧。
+  std::coroutine_handle<> complete(bool& is_detached) {
+    auto node = m_callbacks.exchange(closed_callbacks(), std::memory_order_acq_rel);
+    run_callbacks(node);
+
+    auto executor = m_executor;
+    Continuation continuation;
+    auto state = m_state.load(std::memory_order_acquire);
+    do {
+      if (state & kHasContinuation) {
+        continuation = m_continuation;
+      }
+    } while (!m_state.compare_exchange_weak(state, state | kCompleted, std::memory_order_acq_rel, std::memory_order_acquire));
+    // 之后等待者可能已经销毁了协程帧, 只能使用局部变量。
+
+    if (state & kDetached) {
+      is_detached = true;
+      return nullptr;
+    }
+    if (!(state & kHasContinuation)) {
+      return nullptr;
+    }
+    if (continuation.m_callback) {
+      continuation.m_callback(continuation.m_context);
+      return nullptr;
+    }
+    if (!continuation.m_executor || continuation.m_executor == executor) {
+      return continuation.m_handle;   // 同一个 Executor, 直接在当前线程上恢复 continuation, 不经过队列。
     }
+    continuation.m_executor->execute([handle = continuation.m_handle]() {
+        handle.resume();
+      });
+    return nullptr;
   }
 
-private:
-  void notify_callbacks() {
-    auto value = m_result.value();
-    for (auto& callback : m_completion_callbacks) {
-      callback(value);
+protected:
+  // 只在协程没有结束时才阻塞等待
+  void wait_for_completed() {
+    if (is_completed()) {
+      return;
+    }
+    SyncWaiter waiter;
+    if (set_continuation({nullptr, nullptr, &SyncWaiter::notify, &waiter})) {
+      waiter.wait();
     }
-    m_completion_callbacks.clear();
   }
 
+  std::optional<Result<T>> m_result;
+  AbstractExecutor* m_executor;
+
 private:
-  std::mutex m_mtx;
-  std::condition_variable m_cv;
+  static constexpr unsigned int kCompleted = 1;
+  static constexpr unsigned int kHasContinuation = 2;
+  static constexpr unsigned int kDetached = 4;
 
-  std::optional<Result<T>> m_result;
-  std::list<std::function<void(Result<T>)>> m_completion_callbacks;
+  struct CallbackNode {
+    UniqueFunction<void(const Result<T>&)> m_func;
+    CallbackNode* m_next;
+  };
+
+  struct SyncWaiter {
+    static void notify(void* context) {
+      auto waiter = static_cast<SyncWaiter*>(context);
+      std::lock_guard lg(waiter->m_mtx);
+      waiter->m_is_notified = true;
+      waiter->m_cv.notify_one();
+    }
+    void wait() {
+      std::unique_lock lock(m_mtx);
+      m_cv.wait(lock, [this]() { return m_is_notified; });
+    }
 
-  Executor m_executor;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    bool m_is_notified = false;
+  };
+
+  static CallbackNode* closed_callbacks() {
+    static CallbackNode node;
+    return &node;
+  }
+
+  void run_callbacks(CallbackNode* node) {
+    // 链表是后进先出的, 反转后按注册的顺序调用
+    CallbackNode* reversed = nullptr;
+    while (node) {
+      reversed = std::exchange(node, std::exchange(node->m_next, reversed));
+    }
+    while (reversed) {
+      reversed->m_func(*m_result);
+      delete std::exchange(reversed, reversed->m_next);
+    }
+  }
+
+  std::atomic<unsigned int> m_state{0};
+  Continuation m_continuation;
+  std::atomic<bool> m_is_cancel_requested{false};
+  std::atomic<CallbackNode*> m_callbacks{nullptr};
 };
 
-template<typename Executor>
-class TaskPromise<void, Executor> {
+template<typename T, typename Executor>
+class TaskPromise : public TaskPromiseBase<T> {
 public:
-  Task<void, Executor> get_return_object() {
+  // 协程的参数中有 Executor& 时使用该 Executor, 否则使用共享的 Executor。
+  template<typename... Args>
+  explicit TaskPromise(Args&... args) : TaskPromiseBase<T>(find_executor<Executor>(args...)) {}
+
+  // 协程帧从 FrameAllocator 分配, 按 promise 类型统计
+  static void* operator new(std::size_t size) {
+    return FrameAllocator::allocate<TaskPromise>(size);
+  }
+  static void operator delete(void* ptr, std::size_t size) {
+    FrameAllocator::deallocate(ptr, size);
+  }
+
+  Task<T, Executor> get_return_object() {
     return Task{std::coroutine_handle<TaskPromise>::from_promise(*this)};
   }
   DispatchAwaiter initial_suspend() {
-    return DispatchAwaiter{&m_executor};
+    return DispatchAwaiter{this->m_executor};
   }
-  std::suspend_always final_suspend() noexcept {
+  FinalAwaiter<TaskPromise> final_suspend() noexcept {
     return {};
   }
-  void unhandled_exception() {
-    std::lock_guard lg(m_mtx);
-    m_result = Result<void>(std::current_exception());
 
-    m_cv.notify_all();
-    notify_callbacks();
+  void return_value(T value) {
+    this->m_result = Result<T>(std::move(value));
   }
 
-  void return_void() {
-    std::lock_guard lg(m_mtx);
-
-    m_cv.notify_all();
-    notify_callbacks();
+  T get_result() {
+    this->wait_for_completed();
+    return this->m_result->get();
   }
+};
 
-  template<typename AwaiterImpl>
-  AwaiterImpl await_transform(AwaiterImpl&& awaiter) {
-    awaiter.install_executor(&m_executor);
-    return awaiter;
-  }
+template<typename Executor>
+class TaskPromise<void, Executor> : public TaskPromiseBase<void> {
+public:
+  template<typename... Args>
+  explicit TaskPromise(Args&... args) : TaskPromiseBase<void>(find_executor<Executor>(args...)) {}
 
-  template<typename T1, typename Executor1>
-  TaskAwaiter<T1, Executor1> await_transform(Task<T1, Executor1>&& task) {
-    return await_transform(std::move(task));
+  // 协程帧从 FrameAllocator 分配, 按 promise 类型统计
+  static void* operator new(std::size_t size) {
+    return FrameAllocator::allocate<TaskPromise>(size);
   }
-
-  template<typename Rep, typename Period>
-  SleepAwaiter await_transform(std::chrono::duration<Rep, Period>&& duration) {
-    return await_transform(SleepAwaiter(std::move(duration)));
+  static void operator delete(void* ptr, std::size_t size) {
+    FrameAllocator::deallocate(ptr, size);
   }
 
-  template<typename T1>
-  void get_result() {
-    std::unique_lock lock(m_mtx);
-    if (!m_result.has_value()) {
-      m_cv.wait(lock);
-    }
-    m_result->get();
+  Task<void, Executor> get_return_object() {
+    return Task{std::coroutine_handle<TaskPromise>::from_promise(*this)};
   }
-
-  void on_completed(std::function<void(Result<void>)>&& func) {
-    std::unique_lock lock(m_mtx);
-    if (m_result.has_value()) {
-      auto value = m_result.value();
-      lock.unlock();
-      func(value);
-    } else {
-      m_completion_callbacks.push_back(std::move(func));
-    }
+  DispatchAwaiter initial_suspend() {
+    return DispatchAwaiter{m_executor};
   }
-
-private:
-  void notify_callbacks() {
-    auto value = m_result.value();
-    for (auto& callback : m_completion_callbacks) {
-      callback(value);
-    }
-    m_completion_callbacks.clear();
+  FinalAwaiter<TaskPromise> final_suspend() noexcept {
+    return {};
   }
 
-private:
-  std::mutex m_mtx;
-  std::condition_variable m_cv;
-
-  std::optional<Result<void>> m_result;
-  std::list<std::function<void(Result<void>)>> m_completion_callbacks;
+  void return_void() {
+    m_result = Result<void>();
+  }
 
-  Executor m_executor;
+  void get_result() {
+    wait_for_completed();
+    m_result->get();
+  }
 };
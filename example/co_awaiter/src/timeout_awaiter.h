@@ -0,0 +1,152 @@
+#pragma once
+
+#include <coroutine>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+#include "executor.h"
+#include "scheduler.h"
+#include "task.h"
+
+struct TimeoutException : public std::exception {
+  const char* what() const noexcept {
+    return "Timed out.";
+  }
+};
+
+// 给另一个 awaiter 加上超时: 超时后调用它的 cancel() 把它从等待的对象 (Channel 的等待列表, 子协程的 continuation)
+// 中移除, 然后恢复协程并抛出 TimeoutException.
+// cancel() 返回 false 表示已经来不及了 (例如 writer 已经把它取走), 这时等它被正常恢复, 不算超时。
+template<typename AwaiterImpl>
+class TimeoutAwaiter {
+public:
+  using value_type = decltype(std::declval<AwaiterImpl&>().await_resume());
+
+  TimeoutAwaiter(AwaiterImpl&& awaiter, std::chrono::nanoseconds timeout)
+    : m_awaiter(std::move(awaiter)), m_timeout(timeout) {}
+  TimeoutAwaiter(TimeoutAwaiter&& other)
+    : m_awaiter(std::move(other.m_awaiter)), m_timeout(other.m_timeout), m_executor(other.m_executor) {}
+  // 协程在等待时被销毁: 取消定时器, 之后回调不会再访问这个 awaiter.
+  ~TimeoutAwaiter() {
+    if (!m_state) {
+      return;
+    }
+    TimerHandle timer;
+    {
+      std::lock_guard lg(m_state->m_mtx);
+      m_state->m_awaiter = nullptr;
+      timer = std::move(m_state->m_timer);
+    }
+    timer.cancel();
+  }
+
+  void install_executor(AbstractExecutor* executor) {
+    m_executor = executor;
+    m_awaiter.install_executor(executor);
+  }
+
+  bool await_ready() {
+    return m_awaiter.await_ready();
+  }
+
+  // 先让 m_awaiter 开始等待, 再设置定时器, 这样定时器触发时 cancel() 一定能找到它。
+  // m_awaiter 开始等待后协程可能已经在其他线程上恢复了, 之后只能通过局部变量 state 访问。
+  auto await_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    m_state = std::make_shared<State>();
+    m_state->m_awaiter = this;
+    auto state = m_state;
+
+    using SuspendResult = decltype(m_awaiter.await_suspend(handle));
+    if constexpr (std::is_void_v<SuspendResult>) {
+      m_awaiter.await_suspend(handle);
+      start_timer(state);
+    } else if constexpr (std::is_same_v<SuspendResult, bool>) {
+      auto does_suspend = m_awaiter.await_suspend(handle);
+      if (does_suspend) {
+        start_timer(state);
+      }
+      return does_suspend;
+    } else {
+      std::coroutine_handle<> next = m_awaiter.await_suspend(handle);
+      if (next != handle) {
+        start_timer(state);
+      }
+      return next;
+    }
+  }
+
+  value_type await_resume() {
+    if (m_state) {
+      TimerHandle timer;
+      bool is_timed_out;
+      {
+        std::lock_guard lg(m_state->m_mtx);
+        m_state->m_awaiter = nullptr;
+        timer = std::move(m_state->m_timer);
+        is_timed_out = m_state->m_is_timed_out;
+      }
+      timer.cancel();
+      if (is_timed_out) {
+        throw TimeoutException{};
+      }
+    }
+    return m_awaiter.await_resume();
+  }
+
+private:
+  // 定时器的回调持有 State, 协程恢复以后 m_awaiter 为 nullptr, 回调什么也不做。
+  struct State {
+    std::mutex m_mtx;
+    TimeoutAwaiter* m_awaiter = nullptr;
+    TimerHandle m_timer;
+    bool m_is_timed_out = false;
+  };
+
+  static void start_timer(const std::shared_ptr<State>& state) {
+    std::lock_guard lg(state->m_mtx);
+    auto awaiter = state->m_awaiter;
+    if (!awaiter) {
+      return;   // 已经恢复了
+    }
+    auto on_timeout = [state]() {
+        std::unique_lock lock(state->m_mtx);
+        auto awaiter = state->m_awaiter;
+        if (!awaiter || !awaiter->m_awaiter.cancel()) {
+          return;
+        }
+        state->m_awaiter = nullptr;
+        state->m_is_timed_out = true;
+        auto handle = awaiter->m_handle;
+        lock.unlock();
+        handle.resume();    // 已经在 Executor 的线程上了
+      };
+    if (awaiter->m_executor) {
+      state->m_timer = awaiter->m_executor->execute_after(std::move(on_timeout), awaiter->m_timeout);
+    } else {
+      state->m_timer = shared_scheduler().execute(std::move(on_timeout), awaiter->m_timeout);
+    }
+  }
+
+  AwaiterImpl m_awaiter;
+  std::chrono::nanoseconds m_timeout;
+  AbstractExecutor* m_executor = nullptr;
+  std::coroutine_handle<> m_handle = nullptr;
+  std::shared_ptr<State> m_state;
+};
+
+// co_await with_timeout(channel.read(), 50ms);
+template<typename AwaiterImpl, typename Rep, typename Period>
+TimeoutAwaiter<std::decay_t<AwaiterImpl>> with_timeout(AwaiterImpl&& awaiter, std::chrono::duration<Rep, Period> timeout) {
+  return {std::forward<AwaiterImpl>(awaiter), std::chrono::duration_cast<std::chrono::nanoseconds>(timeout)};
+}
+
+// co_await with_timeout(sub_task(), 50ms); 超时后子协程继续运行, 结束时自己销毁。
+template<typename T, typename Executor, typename Rep, typename Period>
+TimeoutAwaiter<TaskAwaiter<T, Executor>> with_timeout(Task<T, Executor>&& task, std::chrono::duration<Rep, Period> timeout) {
+  return {TaskAwaiter<T, Executor>{std::move(task)}, std::chrono::duration_cast<std::chrono::nanoseconds>(timeout)};
+}
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "unique_function.h"
+
+// 当前时间, 单位是纳秒。使用 steady_clock, 不受系统时间调整 (例如 NTP) 的影响。
+inline long long current_time() {
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// current_time() 的时间转换为 steady_clock 的 time_point, 用于 condition_variable::wait_until.
+inline std::chrono::steady_clock::time_point to_time_point(long long time) {
+  return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(time)));
+}
+
+// 定时器节点, 由 AbstractTimerQueue 的实现直接链接, 插入和删除都不需要额外分配内存。
+// Scheduler 和 TimerHandle 各持有一个引用, 最后一个释放引用的负责删除。
+struct TimerNode {
+  long long m_deadline = 0;        // current_time() 的时间, 纳秒
+  UniqueFunction<void()> m_func;
+  std::atomic<int> m_ref_count{1};
+  bool m_is_queued = false;        // 在 AbstractTimerQueue 中, 由队列所有者的锁保护
+
+  TimerNode* m_prev = nullptr;     // TimingWheel 槽中的双向链表
+  TimerNode* m_next = nullptr;     // 同时用于 pop_expired 返回的单向链表
+  TimerNode** m_slot = nullptr;    // 所在的 TimingWheel 槽
+  std::size_t m_heap_index = 0;    // 在 HeapTimerQueue 中的位置
+};
+
+inline void release_timer_node(TimerNode* node) {
+  if (node->m_ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete node;
+  }
+}
+
+// 定时器的延迟 (实际触发时间 - deadline) 的统计。
+struct TimerLag {
+  std::size_t m_count = 0;
+  long long m_total = 0;      // 纳秒
+  long long m_max = 0;        // 纳秒
+
+  long long mean() const {
+    return m_count ? m_total / static_cast<long long>(m_count) : 0;
+  }
+  TimerLag& operator+=(const TimerLag& other) {
+    m_count += other.m_count;
+    m_total += other.m_total;
+    m_max = other.m_max > m_max ? other.m_max : m_max;
+    return *this;
+  }
+};
+
+// 只由触发定时器的线程写入, 其他线程可以随时读取。
+class TimerLagStats {
+public:
+  void record(long long lag) {
+    m_count.store(m_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    m_total.store(m_total.load(std::memory_order_relaxed) + lag, std::memory_order_relaxed);
+    if (lag > m_max.load(std::memory_order_relaxed)) {
+      m_max.store(lag, std::memory_order_relaxed);
+    }
+  }
+
+  TimerLag get() const {
+    return {m_count.load(std::memory_order_relaxed), m_total.load(std::memory_order_relaxed), m_max.load(std::memory_order_relaxed)};
+  }
+
+private:
+  std::atomic<std::size_t> m_count{0};
+  std::atomic<long long> m_total{0};
+  std::atomic<long long> m_max{0};
+};
+
+// 执行并释放 pop_expired(now) 返回的节点。
+// 延迟按取出时的 now 计算, 不再为每个节点读取时钟, 所以不包括同一批中前面的回调的执行时间。
+inline void run_timer_nodes(TimerNode* list, long long now, TimerLagStats& stats) {
+  while (list) {
+    auto node = std::exchange(list, list->m_next);
+    stats.record(now - node->m_deadline);
+    node->m_func();
+    node->m_func = nullptr;
+    release_timer_node(node);
+  }
+}
+
+// 不执行, 直接释放 pop_all 返回的节点
+inline void discard_timer_nodes(TimerNode* list) {
+  while (list) {
+    auto node = std::exchange(list, list->m_next);
+    node->m_func = nullptr;
+    release_timer_node(node);
+  }
+}
+
+// 可以取消定时器的对象: Scheduler, 或者 Executor 工作线程自己的 TimerShard.
+struct AbstractTimerOwner {
+  virtual bool cancel(TimerNode* node) = 0;
+};
+
+// 定时器句柄, 只能移动。
+// 句柄可以比定时器的所有者活得更久, 但 cancel 只能在所有者销毁之前调用。
+class TimerHandle {
+public:
+  TimerHandle() = default;
+  TimerHandle(AbstractTimerOwner* owner, TimerNode* node) : m_owner(owner), m_node(node) {}
+  TimerHandle(TimerHandle&& other) noexcept
+    : m_owner(std::exchange(other.m_owner, nullptr)), m_node(std::exchange(other.m_node, nullptr)) {}
+  TimerHandle& operator=(TimerHandle&& other) noexcept {
+    if (this != &other) {
+      reset();
+      m_owner = std::exchange(other.m_owner, nullptr);
+      m_node = std::exchange(other.m_node, nullptr);
+    }
+    return *this;
+  }
+  TimerHandle(const TimerHandle&) = delete;
+  TimerHandle& operator=(const TimerHandle&) = delete;
+  ~TimerHandle() {
+    reset();
+  }
+
+  // 定时器还没有触发时取消它, 并立即释放 callable. 返回是否取消成功。
+  bool cancel() {
+    return m_node && m_owner->cancel(m_node);
+  }
+
+  explicit operator bool() const noexcept {
+    return m_node != nullptr;
+  }
+
+private:
+  void reset() {
+    if (m_node) {
+      release_timer_node(std::exchange(m_node, nullptr));
+    }
+    m_owner = nullptr;
+  }
+
+  AbstractTimerOwner* m_owner = nullptr;
+  TimerNode* m_node = nullptr;
+};
+
+// 不是线程安全的, 由所有者加锁访问。
+// push 之后 m_is_queued 为 true, remove 或者被 pop_expired/pop_all 取出后为 false.
+struct AbstractTimerQueue {
+  virtual ~AbstractTimerQueue() = default;
+
+  virtual void push(TimerNode* node) = 0;
+  virtual void remove(TimerNode* node) = 0;
+  virtual bool empty() const = 0;
+  // 下一次需要调用 pop_expired 的时间, 不一定等于最早的 deadline. 只有 !empty() 时有意义。
+  virtual long long next_deadline() const = 0;
+  // 取出所有 deadline <= now 的节点, 通过 m_next 链接。
+  virtual TimerNode* pop_expired(long long now) = 0;
+  // 取出所有节点, 用于丢弃还没有到期的定时器。
+  virtual TimerNode* pop_all() = 0;
+};
+
+// 二叉堆, 插入和删除都是 O(log n)。节点记录自己在堆中的位置, 所以可以删除任意节点。
+class HeapTimerQueue : public AbstractTimerQueue {
+public:
+  void push(TimerNode* node) override {
+    node->m_is_queued = true;
+    node->m_heap_index = m_heap.size();
+    m_heap.push_back(node);
+    sift_up(node->m_heap_index);
+  }
+
+  void remove(TimerNode* node) override {
+    node->m_is_queued = false;
+    auto index = node->m_heap_index;
+    auto last = m_heap.back();
+    m_heap.pop_back();
+    if (last != node) {
+      place(index, last);
+      sift_down(index);
+      sift_up(last->m_heap_index);
+    }
+  }
+
+  bool empty() const override {
+    return m_heap.empty();
+  }
+
+  long long next_deadline() const override {
+    return m_heap.front()->m_deadline;
+  }
+
+  TimerNode* pop_expired(long long now) override {
+    TimerNode* head = nullptr;
+    TimerNode** tail = &head;
+    while (!m_heap.empty() && m_heap.front()->m_deadline <= now) {
+      auto node = m_heap.front();
+      remove(node);
+      node->m_next = nullptr;
+      *tail = node;
+      tail = &node->m_next;
+    }
+    return head;
+  }
+
+  TimerNode* pop_all() override {
+    TimerNode* head = nullptr;
+    for (auto node : m_heap) {
+      node->m_is_queued = false;
+      node->m_next = head;
+      head = node;
+    }
+    m_heap.clear();
+    return head;
+  }
+
+private:
+  void place(std::size_t index, TimerNode* node) {
+    m_heap[index] = node;
+    node->m_heap_index = index;
+  }
+
+  void sift_up(std::size_t index) {
+    auto node = m_heap[index];
+    while (index > 0) {
+      auto parent = (index - 1) / 2;
+      if (m_heap[parent]->m_deadline <= node->m_deadline) {
+        break;
+      }
+      place(index, m_heap[parent]);
+      index = parent;
+    }
+    place(index, node);
+  }
+
+  void sift_down(std::size_t index) {
+    auto node = m_heap[index];
+    while (true) {
+      auto child = index * 2 + 1;
+      if (child >= m_heap.size()) {
+        break;
+      }
+      if (child + 1 < m_heap.size() && m_heap[child + 1]->m_deadline < m_heap[child]->m_deadline) {
+        child++;
+      }
+      if (node->m_deadline <= m_heap[child]->m_deadline) {
+        break;
+      }
+      place(index, m_heap[child]);
+      index = child;
+    }
+    place(index, node);
+  }
+
+  std::vector<TimerNode*> m_heap;
+};
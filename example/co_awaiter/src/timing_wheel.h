@@ -0,0 +1,226 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+#include "timer_queue.h"
+
+// 分层时间轮: 4 层, 每层 256 个槽, 第 0 层每个槽是一个 tick (默认 100 微秒, 4 层一共约 5 天)。
+// 到期时间向上取整到 tick, 所以定时器最多晚一个 tick 触发。
+// 插入和删除都是 O(1); 第 0 层转完一圈时把上一层的一个槽重新分配到下层 (cascade)。
+// 超过最上层范围的节点放在最上层, 等 cascade 时再重新计算。
+// 每层用一个位图记录哪些槽不为空, next_deadline 用位扫描找下一个非空的槽, 也是 O(1),
+// 只有上层有节点时才需要在 cascade 的时候醒来。
+class TimingWheel : public AbstractTimerQueue {
+public:
+  static constexpr long long kDefaultTick = 100'000;
+
+  explicit TimingWheel(long long tick = kDefaultTick, long long now = current_time())
+    : m_tick(tick > 0 ? tick : 1), m_current_tick(now / m_tick) {}
+
+  void push(TimerNode* node) override {
+    node->m_is_queued = true;
+    m_count++;
+    auto tick = (node->m_deadline + m_tick - 1) / m_tick;
+    if (tick <= m_current_tick) {
+      link(m_overdue, node);
+      return;
+    }
+    auto delta = tick - m_current_tick;
+    for (std::size_t level = 0; level < kLevelCount; level++) {
+      if (delta < (1LL << (kSlotBits * (level + 1))) || level == kLevelCount - 1) {
+        if (level == kLevelCount - 1 && delta >= (1LL << (kSlotBits * kLevelCount))) {
+          tick = m_current_tick + (1LL << (kSlotBits * kLevelCount)) - 1;
+        }
+        link_slot(level * kSlotCount + ((tick >> (kSlotBits * level)) & kSlotMask), node);
+        return;
+      }
+    }
+  }
+
+  void remove(TimerNode* node) override {
+    node->m_is_queued = false;
+    m_count--;
+    if (node->m_prev) {
+      node->m_prev->m_next = node->m_next;
+    } else {
+      *node->m_slot = node->m_next;
+      if (!node->m_next && node->m_slot != &m_overdue) {
+        clear_occupied(node->m_slot - m_slots);
+      }
+    }
+    if (node->m_next) {
+      node->m_next->m_prev = node->m_prev;
+    }
+    node->m_prev = node->m_next = nullptr;
+    node->m_slot = nullptr;
+  }
+
+  bool empty() const override {
+    return m_count == 0;
+  }
+
+  // 第 0 层的节点返回它的 tick; 上层的节点返回它所在的槽 cascade 的时间, 这时它会被移到下层, 之后再重新计算。
+  long long next_deadline() const override {
+    if (m_overdue) {
+      return m_current_tick * m_tick;
+    }
+    // 第 0 层的节点在 (m_current_tick, m_current_tick + kSlotCount) 内, 当前的槽已经取空了
+    auto next_tick = kNoTick;
+    auto offset = find_occupied(0, (m_current_tick + 1) & kSlotMask);
+    if (offset >= 0) {
+      next_tick = m_current_tick + 1 + offset;
+    }
+    for (std::size_t level = 1; level < kLevelCount; level++) {
+      // 第 level 层的当前槽中的节点要等到下一圈, 所以从下一个槽开始找
+      auto shift = kSlotBits * level;
+      auto round = m_current_tick >> shift;
+      offset = find_occupied(level, (round + 1) & kSlotMask);
+      if (offset >= 0) {
+        auto tick = (round + 1 + offset) << shift;
+        next_tick = tick < next_tick ? tick : next_tick;
+      }
+    }
+    return next_tick == kNoTick ? kNoTick : next_tick * m_tick;
+  }
+
+  // 一次取出所有到期的节点
+  TimerNode* pop_expired(long long now) override {
+    TimerNode* expired = nullptr;
+    auto now_tick = now / m_tick;
+    if (m_count == 0) {
+      m_current_tick = now_tick > m_current_tick ? now_tick : m_current_tick;
+    }
+    while (m_current_tick < now_tick) {
+      m_current_tick++;
+      if ((m_current_tick & kSlotMask) == 0) {
+        cascade(1);
+      }
+      append(expired, take_slot(m_current_tick & kSlotMask));
+      if (m_count == 0) {
+        m_current_tick = now_tick;
+      }
+    }
+    // cascade 时刚好到期的节点也在 m_overdue 中
+    append(expired, std::exchange(m_overdue, nullptr));
+    for (auto node = expired; node; node = node->m_next) {
+      node->m_prev = nullptr;
+      node->m_slot = nullptr;
+      node->m_is_queued = false;
+    }
+    return expired;
+  }
+
+  TimerNode* pop_all() override {
+    TimerNode* all = nullptr;
+    append(all, std::exchange(m_overdue, nullptr));
+    for (auto& slot : m_slots) {
+      append(all, std::exchange(slot, nullptr));
+    }
+    for (auto& word : m_occupied) {
+      word = 0;
+    }
+    for (auto node = all; node; node = node->m_next) {
+      node->m_is_queued = false;
+    }
+    return all;
+  }
+
+private:
+  static constexpr std::size_t kLevelCount = 4;
+  static constexpr int kSlotBits = 8;
+  static constexpr long long kSlotCount = 1LL << kSlotBits;
+  static constexpr long long kSlotMask = kSlotCount - 1;
+  static constexpr long long kNoTick = std::numeric_limits<long long>::max();
+  static constexpr std::size_t kWordBits = 64;
+  static constexpr std::size_t kWordCount = kSlotCount / kWordBits;   // 每层的位图占几个 uint64_t
+
+  // slot 是 m_slots 中的下标: level * kSlotCount + 槽的序号
+  void link_slot(std::size_t slot, TimerNode* node) {
+    link(m_slots[slot], node);
+    m_occupied[slot / kWordBits] |= std::uint64_t(1) << (slot % kWordBits);
+  }
+
+  TimerNode* take_slot(std::size_t slot) {
+    clear_occupied(slot);
+    return std::exchange(m_slots[slot], nullptr);
+  }
+
+  void clear_occupied(std::size_t slot) {
+    m_occupied[slot / kWordBits] &= ~(std::uint64_t(1) << (slot % kWordBits));
+  }
+
+  // 从第 level 层的 start 号槽开始 (绕一圈) 找第一个非空的槽, 返回它和 start 的距离, 没有时返回 -1.
+  long long find_occupied(std::size_t level, long long start) const {
+    auto words = m_occupied + level * kWordCount;
+    auto first_word = static_cast<std::size_t>(start) / kWordBits;
+    auto first_bit = static_cast<std::size_t>(start) % kWordBits;
+    for (std::size_t i = 0; i <= kWordCount; i++) {
+      auto index = (first_word + i) % kWordCount;
+      auto bits = words[index];
+      if (i == 0) {
+        bits &= ~std::uint64_t(0) << first_bit;
+      } else if (i == kWordCount) {
+        // 回到第一个字, 只看 start 之前的位
+        bits &= first_bit ? ~(~std::uint64_t(0) << first_bit) : 0;
+      }
+      if (bits) {
+        auto slot = static_cast<long long>(index * kWordBits + std::countr_zero(bits));
+        return (slot - start) & kSlotMask;
+      }
+    }
+    return -1;
+  }
+
+  void link(TimerNode*& head, TimerNode* node) {
+    node->m_slot = &head;
+    node->m_prev = nullptr;
+    node->m_next = head;
+    if (head) {
+      head->m_prev = node;
+    }
+    head = node;
+  }
+
+  // 把 list 接到 expired 后面, 并更新计数
+  void append(TimerNode*& expired, TimerNode* list) {
+    if (!list) {
+      return;
+    }
+    auto tail = list;
+    m_count--;
+    while (tail->m_next) {
+      tail = tail->m_next;
+      m_count--;
+    }
+    tail->m_next = expired;
+    expired = list;
+  }
+
+  void cascade(std::size_t level) {
+    if (level >= kLevelCount) {
+      return;
+    }
+    auto index = (m_current_tick >> (kSlotBits * level)) & kSlotMask;
+    if (index == 0) {
+      cascade(level + 1);
+    }
+    auto node = take_slot(level * kSlotCount + index);
+    while (node) {
+      auto next = node->m_next;
+      m_count--;
+      push(node);
+      node = next;
+    }
+  }
+
+  long long m_tick;
+  long long m_current_tick;
+  std::size_t m_count = 0;
+  TimerNode* m_overdue = nullptr;
+  TimerNode* m_slots[kLevelCount * kSlotCount] = {};
+  std::uint64_t m_occupied[kLevelCount * kWordCount] = {};
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// 统计 UniqueFunction 因为 capture 太大而在堆上分配的次数。
+inline std::atomic<std::size_t>& unique_function_heap_allocations() {
+  static std::atomic<std::size_t> count{0};
+  return count;
+}
+
+// 只能移动的 std::function. 不超过 InlineSize 的 callable 直接存放在对象内部, 不分配内存。
+template<typename Signature, std::size_t InlineSize = 48>
+class UniqueFunction;
+
+template<typename R, typename... Args, std::size_t InlineSize>
+class UniqueFunction<R(Args...), InlineSize> {
+public:
+  UniqueFunction() = default;
+  UniqueFunction(std::nullptr_t) {}
+
+  template<typename F,
+           typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, UniqueFunction>
+                                       && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+  UniqueFunction(F&& func) {
+    using Functor = std::decay_t<F>;
+    if constexpr (is_inline<Functor>()) {
+      ::new (static_cast<void*>(m_storage)) Functor(std::forward<F>(func));
+      m_vtable = &s_inline_vtable<Functor>;
+    } else {
+      ::new (static_cast<void*>(m_storage)) Functor*(new Functor(std::forward<F>(func)));
+      unique_function_heap_allocations().fetch_add(1, std::memory_order_relaxed);
+      m_vtable = &s_heap_vtable<Functor>;
+    }
+  }
+
+  UniqueFunction(UniqueFunction&& other) noexcept : m_vtable(std::exchange(other.m_vtable, nullptr)) {
+    if (m_vtable) {
+      m_vtable->move(m_storage, other.m_storage);
+    }
+  }
+  UniqueFunction& operator=(UniqueFunction&& other) noexcept {
+    if (this != &other) {
+      reset();
+      m_vtable = std::exchange(other.m_vtable, nullptr);
+      if (m_vtable) {
+        m_vtable->move(m_storage, other.m_storage);
+      }
+    }
+    return *this;
+  }
+  UniqueFunction& operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+  UniqueFunction(const UniqueFunction&) = delete;
+  UniqueFunction& operator=(const UniqueFunction&) = delete;
+  ~UniqueFunction() {
+    reset();
+  }
+
+  R operator()(Args... args) {
+    return m_vtable->invoke(m_storage, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const noexcept {
+    return m_vtable != nullptr;
+  }
+
+private:
+  struct VTable {
+    R (*invoke)(void* storage, Args&&... args);
+    void (*move)(void* dst, void* src);     // 移动到 dst 并析构 src
+    void (*destroy)(void* storage);
+  };
+
+  template<typename Functor>
+  static constexpr bool is_inline() {
+    return sizeof(Functor) <= InlineSize
+      && alignof(Functor) <= alignof(std::max_align_t)
+      && std::is_nothrow_move_constructible_v<Functor>;
+  }
+
+  template<typename Functor>
+  static inline const VTable s_inline_vtable = {
+    [](void* storage, Args&&... args) -> R {
+      return (*std::launder(static_cast<Functor*>(storage)))(std::forward<Args>(args)...);
+    },
+    [](void* dst, void* src) {
+      auto functor = std::launder(static_cast<Functor*>(src));
+      ::new (dst) Functor(std::move(*functor));
+      functor->~Functor();
+    },
+    [](void* storage) {
+      std::launder(static_cast<Functor*>(storage))->~Functor();
+    },
+  };
+
+  template<typename Functor>
+  static inline const VTable s_heap_vtable = {
+    [](void* storage, Args&&... args) -> R {
+      return (**static_cast<Functor**>(storage))(std::forward<Args>(args)...);
+    },
+    [](void* dst, void* src) {
+      ::new (dst) Functor*(*static_cast<Functor**>(src));
+    },
+    [](void* storage) {
+      delete *static_cast<Functor**>(storage);
+    },
+  };
+
+  void reset() noexcept {
+    if (m_vtable) {
+      std::exchange(m_vtable, nullptr)->destroy(m_storage);
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char m_storage[InlineSize];
+  const VTable* m_vtable = nullptr;
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <coroutine>
+#include <atomic>
+#include <cstddef>
+#include <tuple>
+#include <vector>
+#include <variant>
+#include <type_traits>
+#include <utility>
+
+#include "executor.h"
+#include "task.h"
+
+// when_all 中 void 的结果用 std::monostate 表示
+template<typename T>
+using when_all_result_t = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+// 所有子协程的 continuation 都指向同一个计数器, 最后一个结束的子协程恢复父协程, 父协程只恢复一次。
+// 子协程在创建时就已经开始运行了, 这里只是等待它们全部结束。
+class WhenAllCounter {
+public:
+  explicit WhenAllCounter(std::size_t count) : m_count(count + 1) {}   // 多出来的 1 由 await_suspend 持有
+  // await_transform 在 install_executor 之后移动 awaiter, 需要带上 m_executor. 只在挂起之前移动。
+  WhenAllCounter(WhenAllCounter&& other)
+    : m_count(other.m_count.load(std::memory_order_relaxed)), m_executor(other.m_executor) {}
+  WhenAllCounter(const WhenAllCounter&) = delete;
+  WhenAllCounter& operator=(const WhenAllCounter&) = delete;
+
+  void install_executor(AbstractExecutor* executor) {
+    m_executor = executor;
+  }
+
+  bool await_ready() {
+    return m_count.load(std::memory_order_relaxed) == 1;
+  }
+
+protected:
+  template<typename Promise>
+  void wait_for(Promise& promise) {
+    if (!promise.set_continuation({nullptr, nullptr, &WhenAllCounter::on_completed, this})) {
+      m_count.fetch_sub(1, std::memory_order_acq_rel);    // 已经结束了, 不会是最后一个
+    }
+  }
+
+  // 所有子协程都注册完以后调用, 返回是否需要挂起。
+  bool finish_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    return m_count.fetch_sub(1, std::memory_order_acq_rel) != 1;
+  }
+
+private:
+  static void on_completed(void* context) {
+    auto counter = static_cast<WhenAllCounter*>(context);
+    if (counter->m_count.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    auto handle = counter->m_handle;
+    if (counter->m_executor) {
+      counter->m_executor->execute([handle]() {
+          handle.resume();
+        });
+    } else {
+      handle.resume();
+    }
+  }
+
+  std::atomic<std::size_t> m_count;
+  AbstractExecutor* m_executor = nullptr;
+  std::coroutine_handle<> m_handle = nullptr;
+};
+
+template<typename T, typename Executor>
+when_all_result_t<T> take_when_all_result(Task<T, Executor>& task) {
+  if constexpr (std::is_void_v<T>) {
+    task.get_result();
+    return {};
+  } else {
+    return task.get_result();
+  }
+}
+
+// co_await when_all(task1, task2, ...) 返回 std::tuple, 按参数的顺序抛出第一个异常。
+template<typename... Tasks>
+class WhenAllAwaiter : public WhenAllCounter {
+public:
+  explicit WhenAllAwaiter(Tasks&&... tasks) : WhenAllCounter(sizeof...(Tasks)), m_tasks(std::move(tasks)...) {}
+  WhenAllAwaiter(WhenAllAwaiter&& other) : WhenAllCounter(std::move(other)), m_tasks(std::move(other.m_tasks)) {}
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    std::apply([this](auto&... tasks) {
+        (wait_for(tasks.m_co_handle.promise()), ...);
+      }, m_tasks);
+    return finish_suspend(handle);
+  }
+
+  auto await_resume() {
+    return std::apply([](auto&... tasks) {
+        // 花括号初始化保证从左到右求值
+        return std::tuple<decltype(take_when_all_result(tasks))...>{take_when_all_result(tasks)...};
+      }, m_tasks);
+  }
+
+private:
+  std::tuple<Tasks...> m_tasks;
+};
+
+// co_await when_all(std::move(tasks)) 返回 std::vector, T 是 void 时不返回结果。
+template<typename T, typename Executor>
+class WhenAllVectorAwaiter : public WhenAllCounter {
+public:
+  explicit WhenAllVectorAwaiter(std::vector<Task<T, Executor>>&& tasks) : WhenAllCounter(tasks.size()), m_tasks(std::move(tasks)) {}
+  WhenAllVectorAwaiter(WhenAllVectorAwaiter&& other) : WhenAllCounter(std::move(other)), m_tasks(std::move(other.m_tasks)) {}
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    for (auto& task : m_tasks) {
+      wait_for(task.m_co_handle.promise());
+    }
+    return finish_suspend(handle);
+  }
+
+  auto await_resume() {
+    if constexpr (std::is_void_v<T>) {
+      for (auto& task : m_tasks) {
+        task.get_result();
+      }
+    } else {
+      std::vector<T> results;
+      results.reserve(m_tasks.size());
+      for (auto& task : m_tasks) {
+        results.push_back(task.get_result());
+      }
+      return results;
+    }
+  }
+
+private:
+  std::vector<Task<T, Executor>> m_tasks;
+};
+
+template<typename... Ts, typename... Executors>
+WhenAllAwaiter<Task<Ts, Executors>...> when_all(Task<Ts, Executors>&&... tasks) {
+  return WhenAllAwaiter<Task<Ts, Executors>...>(std::move(tasks)...);
+}
+
+template<typename T, typename Executor>
+WhenAllVectorAwaiter<T, Executor> when_all(std::vector<Task<T, Executor>>&& tasks) {
+  return WhenAllVectorAwaiter<T, Executor>(std::move(tasks));
+}
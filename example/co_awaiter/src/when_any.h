@@ -0,0 +1,204 @@
+#pragma once
+
+#include <coroutine>
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+#include <type_traits>
+#include <utility>
+
+#include "executor.h"
+#include "task.h"
+
+// T 是 void 时只返回最先结束的协程的序号, 否则返回 (序号, 结果)。
+template<typename T>
+using when_any_result_t = std::conditional_t<std::is_void_v<T>, std::size_t, std::pair<std::size_t, T>>;
+
+template<typename... Tasks, typename F>
+void for_each_task(std::tuple<Tasks...>& tasks, F&& func) {
+  std::apply([&func](auto&... task) {
+      std::size_t index = 0;
+      (func(task, index++), ...);
+    }, tasks);
+}
+
+template<typename Task, typename F>
+void for_each_task(std::vector<Task>& tasks, F&& func) {
+  for (std::size_t index = 0; index < tasks.size(); index++) {
+    func(tasks[index], index);
+  }
+}
+
+// 最先结束的子协程恢复父协程, 其余的子协程被请求取消, 并且不再被父协程持有: 它们结束时自己销毁协程帧。
+// 子协程的 continuation 指向一个引用计数的 State, 而不是 awaiter 本身, 所以落后的子协程在父协程恢复之后结束也是安全的。
+// 这里没有使用 on_completed: 它的回调在子协程结束之前调用, 父协程恢复后可能会销毁还没有结束的胜出者。
+template<typename T, typename Tasks>
+class WhenAnyAwaiter {
+public:
+  explicit WhenAnyAwaiter(Tasks&& tasks) : m_tasks(std::move(tasks)) {}
+  WhenAnyAwaiter(WhenAnyAwaiter&& other) : m_tasks(std::move(other.m_tasks)), m_executor(other.m_executor) {}
+  // 只有父协程在挂起时被销毁才会走到这里 (await_resume 已经调用过 finish)。
+  // 先用 kCancelled 占住胜出者, 再拿走 gate: 之后结束的子协程, 以及已经胜出但还没有 arrive 的子协程, 都不会恢复已经销毁的父协程。
+  ~WhenAnyAwaiter() {
+    if (m_state) {
+      m_state->claim(State::kCancelled);
+      m_state->arrive_last();
+    }
+    finish();
+  }
+
+  void install_executor(AbstractExecutor* executor) {
+    m_executor = executor;
+  }
+
+  bool await_ready() {
+    return false;
+  }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    std::size_t count = 0;
+    for_each_task(m_tasks, [&count](auto&, std::size_t) { count++; });
+    m_state = new State(count, handle, m_executor);
+
+    for_each_task(m_tasks, [this](auto& task, std::size_t index) {
+        auto& entry = m_state->m_entries[index];
+        m_state->m_ref_count.fetch_add(1, std::memory_order_relaxed);
+        entry.m_is_registered = task.m_co_handle.promise().set_continuation({nullptr, nullptr, &State::on_completed, &entry});
+        if (!entry.m_is_registered) {
+          // 已经结束了
+          m_state->m_ref_count.fetch_sub(1, std::memory_order_relaxed);
+          if (m_state->claim(index)) {
+            m_state->arrive();
+          }
+        }
+      });
+    // 注册完所有子协程之后才允许恢复父协程
+    return !m_state->arrive_last();
+  }
+
+  when_any_result_t<T> await_resume() {
+    auto winner = m_state->m_winner.load(std::memory_order_acquire);
+    finish();
+
+    std::optional<when_any_result_t<T>> result;
+    for_each_task(m_tasks, [winner, &result](auto& task, std::size_t index) {
+        if (index != winner) {
+          return;
+        }
+        if constexpr (std::is_void_v<T>) {
+          task.get_result();
+          result = index;
+        } else {
+          result.emplace(index, task.get_result());
+        }
+      });
+    return std::move(*result);
+  }
+
+private:
+  struct State;
+
+  struct Entry {
+    State* m_state;
+    bool m_is_registered = false;
+  };
+
+  struct State {
+    static constexpr std::size_t kNoWinner = std::numeric_limits<std::size_t>::max();
+    static constexpr std::size_t kCancelled = kNoWinner - 1;    // 父协程已经销毁
+
+    State(std::size_t count, std::coroutine_handle<> handle, AbstractExecutor* executor)
+      : m_entries(count, Entry{this}), m_handle(handle), m_executor(executor) {}
+
+    static void on_completed(void* context) {
+      auto entry = static_cast<Entry*>(context);
+      auto state = entry->m_state;
+      if (state->claim(entry - state->m_entries.data())) {
+        state->arrive();
+      }
+      state->release();
+    }
+
+    bool claim(std::size_t index) {
+      auto expected = kNoWinner;
+      return m_winner.compare_exchange_strong(expected, index, std::memory_order_acq_rel);
+    }
+
+    // 胜出者和 await_suspend 各调用一次, 后到的恢复父协程
+    void arrive() {
+      if (!arrive_last()) {
+        return;
+      }
+      auto handle = m_handle;
+      if (m_executor) {
+        m_executor->execute([handle]() {
+            handle.resume();
+          });
+      } else {
+        handle.resume();
+      }
+    }
+    bool arrive_last() {
+      return m_gate.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    void release() {
+      if (m_ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+      }
+    }
+
+    std::vector<Entry> m_entries;
+    std::coroutine_handle<> m_handle;
+    AbstractExecutor* m_executor;
+    std::atomic<std::size_t> m_winner{kNoWinner};
+    std::atomic<int> m_gate{2};
+    std::atomic<std::size_t> m_ref_count{1};    // awaiter 一个, 每个注册了 continuation 的子协程一个
+  };
+
+  // 放弃其他子协程: 请求取消, 撤销 continuation. 撤销成功的子协程之后不会再访问 State, 由它自己销毁协程帧;
+  // 已经结束的子协程的回调自己释放 State 的引用, 协程帧随 Task 一起销毁。
+  void finish() {
+    if (!m_state) {
+      return;
+    }
+    auto winner = m_state->m_winner.load(std::memory_order_acquire);
+    for_each_task(m_tasks, [this, winner](auto& task, std::size_t index) {
+        if (index == winner || !task.m_co_handle) {
+          return;
+        }
+        auto& promise = task.m_co_handle.promise();
+        promise.request_cancel();
+        if (promise.detach_continuation()) {
+          if (m_state->m_entries[index].m_is_registered) {
+            m_state->release();
+          }
+          task.m_co_handle = nullptr;
+        }
+      });
+    std::exchange(m_state, nullptr)->release();
+  }
+
+  Tasks m_tasks;
+  AbstractExecutor* m_executor = nullptr;
+  State* m_state = nullptr;
+};
+
+// co_await when_any(task1, task2, ...), 所有子协程的结果类型必须相同。
+template<typename T, typename... Executors>
+WhenAnyAwaiter<T, std::tuple<Task<T, Executors>...>> when_any(Task<T, Executors>&&... tasks) {
+  static_assert(sizeof...(Executors) > 0, "when_any needs at least one task");
+  return WhenAnyAwaiter<T, std::tuple<Task<T, Executors>...>>(std::tuple<Task<T, Executors>...>(std::move(tasks)...));
+}
+
+template<typename T, typename Executor>
+WhenAnyAwaiter<T, std::vector<Task<T, Executor>>> when_any(std::vector<Task<T, Executor>>&& tasks) {
+  if (tasks.empty()) {
+    throw std::invalid_argument("when_any needs at least one task");
+  }
+  return WhenAnyAwaiter<T, std::vector<Task<T, Executor>>>(std::move(tasks));
+}